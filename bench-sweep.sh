@@ -0,0 +1,130 @@
+#!/bin/sh
+# bench-sweep.sh - headless benchmark over a matrix of sizes, flicker rates
+# and densities, written as CSV with 95% confidence intervals, and checked
+# against a baseline.
+#
+# usage: bench-sweep.sh BIN OUT.csv [BASELINE.csv]
+#
+# Every configuration gets SWEEP_WARMUP runs that are thrown away, then
+# SWEEP_RUNS runs of SWEEP_FRAMES frames (all --seed 1, so bytes/frame is
+# the same each run).
+#
+# The baseline CSV gates bytes/frame only: a configuration fails when its
+# bytes/frame grew by more than SWEEP_BYTES_THRESHOLD percent. Timings
+# can't be gated against numbers recorded earlier. On a busy or virtual
+# machine, the same binary comes out 20-45% apart between sweeps a few
+# minutes apart, even though the runs within one sweep agree.
+#
+# Timings are gated against a reference binary instead, SWEEP_REF (the
+# Makefile passes the one 'make bench-baseline' saved). It runs in turn
+# with BIN, run for run, so both see the same machine. A configuration
+# fails when BIN's best run is more than SWEEP_THRESHOLD percent slower
+# than the reference's best run. Without SWEEP_REF, a sweep against a
+# baseline warns that timings were NOT gated; its ns columns are still
+# written, for reading, not checked.
+set -u
+
+BIN=${1:?usage: bench-sweep.sh BIN OUT.csv [BASELINE.csv]}
+OUT=${2:?usage: bench-sweep.sh BIN OUT.csv [BASELINE.csv]}
+BASE=${3:-}
+REF=${SWEEP_REF:-}
+
+SIZES=${SWEEP_SIZES:-"80x24 200x60 400x100 1000x400"}
+FLICKER=${SWEEP_FLICKER:-"0 1 10"}
+DENSITY=${SWEEP_DENSITY:-"1 4"}
+FRAMES=${SWEEP_FRAMES:-2000}
+RUNS=${SWEEP_RUNS:-5}
+WARMUP=${SWEEP_WARMUP:-1}
+THRESHOLD=${SWEEP_THRESHOLD:-25}
+BYTES_THRESHOLD=${SWEEP_BYTES_THRESHOLD:-1}
+
+if [ -n "$BASE" ] && [ ! -f "$BASE" ]; then
+  echo "bench-sweep: no baseline $BASE (make bench-baseline)" >&2
+  exit 1
+fi
+if [ -n "$REF" ] && [ ! -x "$REF" ]; then
+  echo "bench-sweep: no reference binary $REF (make bench-baseline)" >&2
+  exit 1
+fi
+
+tmp=$(mktemp) || exit 1
+trap 'rm -f "$tmp" "$tmp.ref" "$tmp.run" "$tmp.time"' EXIT INT TERM
+: > "$tmp.time"
+
+# one run of $1 on the current configuration: ns/frame ns/cell bytes/frame
+bench() {
+  "$1" --bench "$FRAMES" --seed 1 -s "$s" -f "$f" -d "$d" > "$tmp.run" || exit 1
+  awk '/^  total/ { t = $2; c = $4 } /^  steady/ { b = $2 } END { print t, c, b }' "$tmp.run"
+}
+
+echo "size,flicker,density,frames,runs,ns_frame,ns_frame_ci95,ns_cell,ns_cell_ci95,bytes_frame,bytes_frame_ci95,ns_frame_best" > "$OUT"
+for s in $SIZES; do
+  for f in $FLICKER; do
+    for d in $DENSITY; do
+      i=0
+      while [ $i -lt "$WARMUP" ]; do
+        bench "$BIN" > /dev/null
+        [ -z "$REF" ] || bench "$REF" > /dev/null
+        i=$((i + 1))
+      done
+      : > "$tmp"
+      : > "$tmp.ref"
+      i=0
+      while [ $i -lt "$RUNS" ]; do
+        bench "$BIN" >> "$tmp"
+        [ -z "$REF" ] || bench "$REF" >> "$tmp.ref"
+        i=$((i + 1))
+      done
+      # mean and t-based 95% interval half-width of each column, best ns/frame
+      awk -v key="$s,$f,$d,$FRAMES,$RUNS" '
+        BEGIN { split("12.706 4.303 3.182 2.776 2.571 2.447 2.365 2.306 2.262 2.228 " \
+                      "2.201 2.179 2.160 2.145 2.131 2.120 2.110 2.101 2.093 2.086", T, " ") }
+        { n++; for (k = 1; k <= 3; k++) { x[k, n] = $k; sum[k] += $k }
+          if (n == 1 || $1 < best) best = $1 }
+        END {
+          t = n - 1 <= 20 ? T[n - 1] : 1.96
+          line = key
+          for (k = 1; k <= 3; k++) {
+            m = sum[k] / n; ss = 0
+            for (j = 1; j <= n; j++) ss += (x[k, j] - m) ^ 2
+            ci = n > 1 ? t * sqrt(ss / (n - 1)) / sqrt(n) : 0
+            line = line sprintf(",%.1f,%.1f", m, ci)
+          }
+          print line sprintf(",%.1f", best)
+        }' "$tmp" >> "$OUT"
+      tail -n 1 "$OUT"
+      [ -z "$REF" ] || awk -v key="$s,$f,$d" -v cur="$(tail -n 1 "$OUT" | cut -d, -f12)" \
+        '{ if (NR == 1 || $1 < best) best = $1 } END { print key, best, cur }' "$tmp.ref" >> "$tmp.time"
+    done
+  done
+done
+
+[ -n "$BASE" ] || [ -n "$REF" ] || exit 0
+[ -n "$REF" ] || echo "bench-sweep: WARNING: no reference binary (SWEEP_REF), timings NOT gated" >&2
+awk -F, -v th="$THRESHOLD" -v bth="$BYTES_THRESHOLD" -v timed="$REF" '
+  FILENAME == ARGV[1] { split($0, r, " "); ref[r[1]] = r[2]; cur[r[1]] = r[3]; next }
+  FNR == 1 { next }
+  FILENAME == ARGV[2] { by[$1 "," $2 "," $3] = $10; next }
+  {
+    k = $1 "," $2 "," $3
+    line = sprintf("  %-20s", k); bad = 0
+    if (timed != "") {
+      dt = (cur[k] - ref[k]) / ref[k] * 100
+      line = line sprintf(" best ns/frame %10.1f -> %10.1f (%+6.1f%%)", ref[k], cur[k], dt)
+      bad += dt > th
+    }
+    if (k in by) {
+      db = by[k] > 0 ? ($10 - by[k]) / by[k] * 100 : 0
+      line = line sprintf("  bytes/frame %8.1f -> %8.1f (%+5.1f%%)", by[k], $10, db)
+      bad += db > bth
+    } else if (ARGV[2] != "/dev/null") {
+      line = line "  not in baseline"
+    }
+    print line (bad ? "  FAIL" : "")
+    fail += bad > 0; n++
+  }
+  END {
+    if (fail) { printf "bench-sweep: %d of %d configurations regressed\n", fail, n; exit 1 }
+    printf "bench-sweep: no regressions (%s%s%% bytes)\n",
+           timed != "" ? th "% time against " timed ", " : "timings NOT gated, ", bth
+  }' "$tmp.time" "${BASE:-/dev/null}" "$OUT"
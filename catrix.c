@@ -10,47 +10,348 @@
 #include <signal.h>
 #include <string.h>
 #include <fcntl.h>
+#include <math.h>
+#include <termios.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+/* declared by unistd.h only with _DEFAULT_SOURCE */
+long syscall(long number, ...);
+#endif
+
+/* USDT probes (provider "catrix") when systemtap's header-only sys/sdt.h
+   is there: a nop each until a tracer attaches, e.g.
+   bpftrace -e 'usdt:./build/catrix:catrix:render__done { @ = hist(arg1); }'
+   Build with -DCATRIX_NO_USDT to leave them out. */
+#if !defined(CATRIX_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CATRIX_USDT 1
+#endif
+#endif
+#ifdef CATRIX_USDT
+#define PROBE1(name, a)       DTRACE_PROBE1(catrix, name, a)
+#define PROBE2(name, a, b)    DTRACE_PROBE2(catrix, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(catrix, name, a, b, c)
+#else
+#define PROBE1(name, a)       ((void)(a))
+#define PROBE2(name, a, b)    ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
 
 /* time constants */
 #define NSEC_PER_SEC 1000000000ull
 #define TARGET_FPS 60u
 #define FRAME_NS (NSEC_PER_SEC / TARGET_FPS)
+/* longest idle stretch between resize polls while nothing changes */
+#define IDLE_POLL_FRAMES (TARGET_FPS / 10u)
+/* frame rate divisor while the terminal window is unfocused (4 fps) */
+#define UNFOCUSED_FPS_DIV (TARGET_FPS / 4u)
 
-/* characters for rain */
+/* built-in glyph sets (UTF-8, every glyph must be one terminal column wide) */
 static const char CHARS[] = ":-=0123456789!@#$%&#$[]|<>?ODUCQAB";
 
-/* matrix column */
+struct glyph_set {
+  const char *name;
+  const char *chars;
+};
+
+static const struct glyph_set GLYPH_SETS[] = {
+  { "ascii",    CHARS },
+  { "katakana", "0123456789:=*+-<>|"
+                "ｦｧｨｩｪｫｬｭｮｯｰｱｲｳｴｵｶｷｸｹｺｻｼｽｾｿﾀﾁﾂﾃﾄﾅﾆﾇﾈﾉﾊﾋﾌﾍﾎﾏﾐﾑﾒﾓﾔﾕﾖﾗﾘﾙﾚﾛﾜﾝ" },
+  { "binary",   "01" },
+};
+
+/* glyph table: UTF-8 bytes padded to 4 so emitting one is a fixed-size copy */
+typedef struct {
+  char    utf8[4];
+  uint8_t len;
+} Glyph;
+
+#define MAX_GLYPHS 65535
+
+/* falling drop; drops live in a fixed pool and are chained per column */
 struct blue_pill {
-  char *rsi;
   float speed;
   int   lifespan; /* trail length */
-  float cycle;    /* head position */
+  float cycle;    /* head position (at the column's last update) */
   int   bold;
+  int   next;     /* next drop in the column or free list, -1 = end */
+  uint64_t born;  /* frame of cycle 0; cycle = (frame - born) * speed */
+};
+
+/* rows [lo, hi] drawn in one style */
+struct span {
+  int lo, hi;
+  int style;
+};
+
+/* a run of cells to update on one row, all in one style */
+struct run {
+  int start, end; /* canvas columns [start, end) */
+  int style;
+};
+
+/* matrix column: its drops and the spans last rasterized for them */
+struct column {
+  int   drops;    /* newest drop first, -1 = none */
+  int   count;    /* drops alive */
+  float spacing;  /* head travel before the next drop may start */
+  int   nspans;   /* spans in col_spans */
+  int   visible;  /* rows covered by those spans */
+  uint64_t due;   /* next frame with a visible change (scheduler key) */
+  uint32_t spawned; /* drops started so far, keys their parameters */
+  uint64_t wake;  /* while empty: frame the next drop may start */
+  double flick_at; /* time of the next glyph flicker in this column */
 };
 
 /* render cell (grid for diffing) */
 typedef struct {
-  char    ch;    /* printable char or space */
-  uint8_t style; /* 0=blank, 1=tail1(dark), 2=tail2(mid), 3=tail3(bright), 4=neck, 5=head */
+  uint16_t glyph; /* index into GLYPHS (ignored when blank) */
+  uint8_t  style; /* 0=blank, 1=tail1(dark), 2=tail2(mid), 3=tail3(bright), 4=neck, 5=head, 6+ gradient shades */
 } Cell;
 
 /* Globals */
 static int PHYS_COLS = 0, PHYS_ROWS = 0;  /* physical terminal size */
-static int COLS = 0, ROWS = 0;            /* logical grid: ceil(phys/2) x phys_rows */
-static struct blue_pill *matrix = NULL;
+static int COLS = 0, ROWS = 0;            /* logical canvas: ceil(phys/2) x phys_rows */
+static int VIEW_X = 0, VIEW_Y = 0;        /* viewport origin on the canvas (logical) */
+static int VIEW_COLS = 0, VIEW_ROWS = 0;  /* viewport size, clipped to the canvas */
+static struct column *matrix = NULL;
+static uint64_t FRAME = 0;                /* simulation frame counter */
 static volatile sig_atomic_t resize_pending = 0;
 static volatile sig_atomic_t exit_pending   = 0;
+static volatile sig_atomic_t suspend_pending = 0; /* SIGTSTP */
+static volatile sig_atomic_t resume_pending  = 0; /* SIGCONT */
+
+/* drop pool: COLS * density entries, recycled through a free list */
+static struct blue_pill *pool = NULL;
+static int pool_cap = 0, pool_free = -1, pool_used = 0;
+static double IDLE_MEAN = 0.0;  /* mean frames an emptied column waits (--sparsity) */
+
+/* per-column drawn spans (SPAN_CAP each) and scratch for merging */
+static struct span *col_spans = NULL, *span_new = NULL, *span_raw = NULL;
+static int SPAN_CAP = 0;
+
+/* scheduler: min-heap of columns by due frame; columns due this frame */
+static int *sched_heap = NULL, *due_cols = NULL;
+static int sched_len = 0, due_count = 0;
+
+/* active glyph table */
+static Glyph *GLYPHS = NULL;
+static char (*GLYPH_PAIRS)[8] = NULL;   /* each glyph followed by its gap space */
+static int GLYPH_COUNT = 0;
+/* Walker alias table over the glyphs: slot i is kept when the low 32 bits
+   of a draw are <= GLYPH_PROB[i], else GLYPH_ALIAS[i] is used instead */
+static uint32_t *GLYPH_PROB = NULL;
+static uint16_t *GLYPH_ALIAS = NULL;
+static uint64_t glyph_draws = 0;        /* counter behind rand_glyph */
+static const char *glyph_set_name = "ascii";
+
+/* command line options */
+static struct {
+  const char *glyphs;     /* built-in set name */
+  const char *chars;      /* custom UTF-8 glyphs, overrides glyphs */
+  const char *weights;    /* --weights: "W:GLYPHS ...", overrides both */
+  const char *glyph_file; /* --glyph-file: the same, read from a file */
+  long        bench;      /* >0: headless benchmark of N frames */
+  int         fixed_cols; /* --size: physical size, disables tty polling */
+  int         fixed_rows;
+  int         canvas_cols; /* --canvas: physical virtual canvas size */
+  int         canvas_rows;
+  int         view_x;      /* --viewport: physical origin on the canvas */
+  int         view_y;
+  int         density;     /* max concurrent drops per column */
+  double      sparsity;    /* share of time a column sits empty */
+  double      flicker;     /* chance per visible cell per frame */
+  double      cpu_budget;  /* --cpu-budget: share of one CPU, 0 = none */
+  float       speed;       /* drop speed scale */
+  int         adaptive;    /* per-row choice of diff runs vs rewrite */
+  int         spans;       /* render from column spans, no cell grid */
+  int         counter_glyphs; /* spans: glyphs hashed from (cell, epoch) */
+  uint64_t    start_frame; /* --start-frame: seek here before the first frame */
+  long        max_bps;     /* --max-bps: output budget in bytes/s, 0 = none */
+  int         focus;       /* --focus: slow down while the window is unfocused */
+  const char *shm;         /* --shm: POSIX shared memory name to publish to */
+  int         fall;        /* --fall: glyphs move with the rain, FALL_* */
+  int         output;      /* --output: how frames are assembled, OUT_* */
+  int         gradient;    /* --gradient: trail shades, 0 = tail1-3 */
+  int         truecolor;   /* --truecolor: 24-bit gradient escapes */
+  int         perf;        /* --perf: hardware counters per stage in --bench */
+  const char *stats_sock;  /* --stats-sock: Unix socket serving JSON stats */
+  int         sync;        /* --sync: frames bracketed by DEC mode 2026 */
+  unsigned    seed;
+  int         have_seed;
+} OPT = { "ascii", NULL, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 1, 0.0, 0.01, 0.0, 1.0f, 1, 1, 1, 0, 0, 0, NULL, 0, 0, 0, 0, 0, NULL, 0, 0u, 0 };
+
+/* output counters (bytes/frame is the figure to watch for multi-byte sets) */
+static struct {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t cells;  /* cells emitted */
+  uint64_t runs;   /* cursor moves emitted */
+  uint64_t skipped; /* frames where nothing visible changed */
+  uint64_t rewrites; /* rows sent as a whole rewrite instead of runs */
+  uint64_t iov_frames; /* frames assembled as an iovec list */
+} STATS;
 
-/* double buffer for diff rendering */
-static Cell *prev_grid = NULL, *cur_grid = NULL;
-static size_t grid_cap_cells = 0;
+/* frame stages timed for --cpu-budget */
+enum { STAGE_SIM, STAGE_BUILD, STAGE_RENDER, STAGE_WRITE, STAGE_OTHER, STAGE_COUNT };
+
+#define QUALITY_MAX 10          /* entries of QUALITY_LEVELS */
+#define QUALITY_STEP_FRAMES 4   /* frames between steps on an empty bucket */
+
+/* output quality; lowered step by step to stay under --max-bps, and
+   scaled by the CPU controller to stay under --cpu-budget */
+static struct {
+  int      level;     /* index into QUALITY_LEVELS */
+  double   flicker;   /* flicker in effect (OPT.flicker scaled) */
+  int      depth;     /* 0: 256 colours, 1: 16 colours, 2: one colour */
+  int      fps_div;   /* render every fps_div-th frame */
+  double   tokens;    /* bytes that may still be sent (token bucket) */
+  uint64_t win_frames, win_bytes; /* current one-second window */
+  double   rate;      /* bytes/s measured over the last window */
+  int      calm;      /* windows in a row well under budget */
+  uint64_t dropped;   /* frames not sent for lack of tokens */
+  uint64_t win_dropped; /* ... in the current window */
+  int      repaint;   /* a colour depth change waits for tokens to repaint */
+  uint64_t step_at;   /* frame of the last step down for lack of tokens */
+  uint64_t reached[QUALITY_MAX]; /* 1 + frame each level was first set, 0 = never */
+  uint64_t first_drop; /* 1 + frame of the first dropped frame, 0 = none */
+  double   effort;    /* CPU controller output, 1 = full */
+  double   keep;      /* fraction of columns allowed to start drops */
+  uint64_t cpu_mark;  /* thread CPU time at the end of the last stage */
+  uint64_t stage_ns[STAGE_COUNT]; /* thread CPU time per stage, total */
+  uint64_t cpu_win_frames, cpu_win_ns; /* current one-second window */
+  double   cpu_used;  /* CPU share measured over the last window */
+  int      settle;    /* windows to wait before the next adjustment */
+} Q = { .effort = 1.0, .keep = 1.0 };
+
+/* tiled canvas: TILE_W x TILE_H cell tiles, allocated only while they hold
+   something visible; a two-level dirty bitmap (bit per tile, summary bit per
+   64 tiles) lets a frame touch only the tiles that changed */
+#define TILE_SHIFT_X 6
+#define TILE_SHIFT_Y 4
+#define TILE_W (1 << TILE_SHIFT_X)   /* logical columns */
+#define TILE_H (1 << TILE_SHIFT_Y)
+#define TILE_CELLS (TILE_W * TILE_H)
+
+typedef struct Tile {
+  Cell cur[TILE_CELLS];
+  Cell prev[TILE_CELLS];    /* as last encoded (meaningful inside the viewport) */
+  uint32_t live;            /* non-blank cells in cur */
+  uint16_t dirty_rows;      /* bit per tile row changed since the last encode */
+  struct Tile *next_free;
+} Tile;
+
+static Tile **tiles = NULL;             /* TILES_X * TILES_Y, NULL = all blank */
+static int TILES_X = 0, TILES_Y = 0;
+static uint64_t *dirty_l1 = NULL;       /* bit per tile */
+static uint64_t *dirty_l0 = NULL;       /* bit per dirty_l1 word */
+static size_t dirty_l1_words = 0, dirty_l0_words = 0;
+static Tile *tile_free = NULL;          /* recycled tiles */
+static size_t tiles_live = 0, tiles_total = 0;
+/* tiles are taken in order from chunks of TILE_CHUNK; canvas_alloc reserves
+   chunks for up to TILE_RESERVE bytes of them, so frames don't allocate
+   unless a huge canvas outgrows that */
+#define TILE_CHUNK 256                  /* 2 MiB */
+#define TILE_RESERVE (64u << 20)
+static Tile **tile_chunks = NULL;       /* room for every chunk the canvas may need */
+static size_t tile_nchunks = 0, tile_chunks_cap = 0;
+static size_t tile_reserved = 0;        /* chunks reserved with the canvas */
 
 /* big output buffer reused each frame */
 static char *outbuf = NULL;
 static size_t out_cap = 0;
 
-/* 256-color SGR (no truecolor) */
-static const char *SGR_MAP[] = {
+/* --output: a frame is either copied whole into outbuf, or assembled as an
+   iovec list that points at the SGR strings and glyph pairs where they are
+   and at outbuf only for the bytes made up per frame (cursor moves, counts).
+   auto times both, per class of average run length (cells per cursor move),
+   and uses the faster one for the class of the frame before. Headless
+   frames are never written, so --bench runs auto as copy. */
+enum { OUT_AUTO, OUT_COPY, OUT_IOVEC };
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define RUN_CLASSES 5     /* runs of <2, 2-3, 4-7, 8-15, 16+ cells */
+#define OUT_RECHECK 64    /* frames of a class between tries of the slower one */
+#define OUT_WARMUP 8      /* samples of each mode per class before choosing */
+#define OUT_MARGIN 0.9    /* the other mode must take under 90% as long to win */
+static struct iovec *out_iov = NULL;
+static int iov_cap = 0, frame_niov = 0; /* frame_niov > 0: last frame is out_iov */
+static int use_iov = 0;
+static struct {
+  double   ns[2][RUN_CLASSES];    /* encode + write time, copy and iovec ... */
+  double   bytes[2][RUN_CLASSES]; /* ... for these bytes: ns/bytes per byte */
+  uint32_t n[2][RUN_CLASSES];     /* samples behind them */
+  uint32_t frames[RUN_CLASSES];
+  uint8_t  pick[RUN_CLASSES];  /* mode in use per class (1 = iovec) */
+  int      cls;                /* class of the last frame built */
+  uint64_t t0;                 /* when it started */
+} OUTSEL;
+
+/* per-row encoder scratch: runs of the row and an alternative encoding */
+static struct run *row_runs = NULL;
+static char *row_scratch = NULL;
+static int row_cap = 0;
+
+/* span renderer: no cell grid; the frame state is the spans of each column,
+   plus the glyphs under the viewport and the cells changed this frame */
+struct cell_ref {
+  int x, y; /* viewport cell */
+};
+
+/* a cell's counter glyphs repeat only once its epoch wraps, after 2^32
+   changes; a narrower epoch gives a visible cycle under steady flicker */
+static uint16_t *view_glyphs = NULL;    /* VIEW_COLS * VIEW_ROWS, stored glyphs */
+static uint32_t *view_epoch = NULL;     /* VIEW_COLS * VIEW_ROWS, counter glyphs */
+static uint64_t RNG_KEY = 0;            /* seeds the counter-based hashes */
+static struct cell_ref *chg = NULL, *chg_tmp = NULL;
+static int chg_count = 0, chg_cap = 0;
+static uint8_t *chg_mark = NULL;        /* VIEW_COLS * VIEW_ROWS, 1 = on the list */
+
+/* --fall: streams of glyphs that move down as a whole, one row per scroll.
+   The viewport is kept as a ring of rows, so a scroll costs one row here
+   and one SD sequence on the terminal (FALL_SCROLL), or resends every cell
+   that moved (FALL_REWRITE, for comparison). The changed cells go through
+   the span renderer's change list. */
+enum { FALL_OFF, FALL_SCROLL, FALL_REWRITE };
+
+struct fall_col {
+  int left;  /* cells of the current stream still to enter at the top */
+  int len;   /* its length */
+  int gap;   /* blank rows before the next stream, while left == 0 */
+  int bold;
+};
+
+static Cell *fall_ring = NULL;          /* VIEW_ROWS rows, screen row y at (fall_top + y) */
+static Cell *fall_row = NULL;           /* VIEW_COLS, the row entering at the top */
+static struct fall_col *fall_cols = NULL;
+static int fall_top = 0;
+static int fall_pending = 0;            /* rows scrolled since the last frame sent */
+static int fall_live = 0;               /* non-blank cells in the ring */
+static uint64_t fall_frame = 0;         /* frame the streams were last brought to */
+static double fall_acc = 0.0, fall_flick = 0.0; /* fractional scrolls and flickers */
+
+/* trail gradient: --gradient N draws the trail in N shades, styles
+   STYLE_GRAD + k from dark to bright, in place of tail1-3 */
+#define GRADIENT_MAX 64
+#define STYLE_GRAD 6
+#define STYLE_COUNT (STYLE_GRAD + GRADIENT_MAX)
+#define RANK_COUNT (4 + GRADIENT_MAX + 2)
+
+/* 256-color SGR; gradient entries point into GRADIENT_SGR */
+static const char *SGR_MAP[STYLE_COUNT] = {
   NULL,             /* 0 blank - no SGR needed */
   "\x1b[38;5;22m",  /* 1 tail1 dark */
   "\x1b[38;5;40m",  /* 2 tail2 mid */
@@ -59,20 +360,399 @@ static const char *SGR_MAP[] = {
   "\x1b[1;38;5;15m" /* 5 head bold white */
 };
 
+/* 16-color SGR, shorter, for reduced colour depth */
+static const char *SGR_16[STYLE_COUNT] = {
+  NULL,
+  "\x1b[32m",   /* 1 tail1 green */
+  "\x1b[32m",   /* 2 tail2 green */
+  "\x1b[92m",   /* 3 tail3 bright green */
+  "\x1b[92m",   /* 4 neck (not used, see STYLE_MAP) */
+  "\x1b[1;97m"  /* 5 head bold white */
+};
+
+/* styles per colour depth: 16 colours folds the neck into tail3, one
+   colour keeps only the head apart; gradient columns are set by
+   init_styles */
+static uint8_t STYLE_MAP[3][STYLE_COUNT] = {
+  { 0, 1, 2, 3, 4, 5 },
+  { 0, 1, 2, 3, 3, 5 },
+  { 0, 2, 2, 2, 2, 5 },
+};
+
+/* brightness order where drops overlap: tail1-3, gradient shades, neck,
+   head, up to RANK_TOP; the two trail sets never meet in one frame */
+static uint8_t STYLE_RANK[STYLE_COUNT];
+static uint8_t RANK_STYLE[RANK_COUNT];
+static int RANK_TOP = 5;
+
+/* pre-rendered gradient escapes, one per distinct quantised colour */
+static char GRADIENT_SGR[GRADIENT_MAX][24];
+
+/* quality steps for --max-bps, best first: flicker goes first, then
+   colour depth, then frame rate; past the last one frames are dropped */
+static const struct {
+  float flicker; /* scale of OPT.flicker */
+  int   depth;
+  int   fps_div;
+} QUALITY_LEVELS[QUALITY_MAX] = {
+  { 1.0f,  0, 1 }, { 0.5f, 0, 1 }, { 0.25f, 0, 1 }, { 0.1f, 0, 1 }, { 0.0f, 0, 1 },
+  { 0.0f,  1, 1 }, { 0.0f, 2, 1 },
+  { 0.0f,  2, 2 }, { 0.0f, 2, 4 }, { 0.0f, 2, 6 },
+};
+#define QUALITY_COUNT ((int)(sizeof(QUALITY_LEVELS) / sizeof(QUALITY_LEVELS[0])))
+
 /* --- utils --- */
-static inline int chars_len(void) { return (int)(sizeof(CHARS) - 1); }
+/* SplitMix64 finalizer */
+static inline uint64_t mix64(uint64_t z) {
+  z += 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+/* glyph for a 64-bit random draw: the high half picks a slot (multiply and
+   shift, no division), the low half decides between it and its alias */
+static inline uint16_t alias_pick(uint64_t u) {
+  uint32_t i = (uint32_t)(((u >> 32) * (uint64_t)GLYPH_COUNT) >> 32);
+  return (uint32_t)u <= GLYPH_PROB[i] ? (uint16_t)i : GLYPH_ALIAS[i];
+}
+
+static inline uint16_t rand_glyph(void) { return alias_pick(mix64(RNG_KEY ^ glyph_draws++)); }
+
+/* counter-based glyph of canvas cell (c, r) at a given epoch: the same
+   inputs always give the same glyph, so nothing but the epoch is stored */
+static inline uint16_t hash_glyph(int c, int r, uint32_t epoch) {
+  uint64_t h = mix64(RNG_KEY ^ ((uint64_t)(uint32_t)c << 32 | (uint64_t)(uint32_t)r));
+  return alias_pick(mix64(h + epoch));
+}
+
+static inline Cell *fall_cell(int x, int y) {
+  int ry = fall_top + y;
+  if (ry >= VIEW_ROWS) ry -= VIEW_ROWS;
+  return &fall_ring[(size_t)ry * (size_t)VIEW_COLS + (size_t)x];
+}
 
-static inline int rand_range(int lo, int hi) {
-  if (hi < lo) return lo;
-  return lo + (rand() % (hi - lo + 1));
+static inline int floor_int(float f) { int i = (int)f; return ((float)i > f) ? i - 1 : i; }
+static inline int ceil_int(float f)  { int i = (int)f; return ((float)i < f) ? i + 1 : i; }
+
+/* exponential waiting time for events at 'rate' per frame */
+static inline double rand_exp(double rate) {
+  if (rate <= 0.0) return HUGE_VAL;
+  double u = ((double)rand() + 1.0) / ((double)RAND_MAX + 1.0);
+  return -log(u) / rate;
+}
+
+/* uniform in [0, 1] from the top 24 bits of a hash */
+static inline float hash_unit(uint64_t h) {
+  return (float)(h >> 40) / 16777215.0f;
+}
+
+/* whether column c may start drops (--cpu-budget thins columns out in a
+   fixed, scattered order) */
+static inline int column_active(int c) {
+  if (Q.keep >= 1.0) return 1;
+  return hash_unit(mix64(RNG_KEY ^ 0x632be59bd9b4e019ull ^ (uint64_t)(uint32_t)c)) < Q.keep;
+}
+
+/* frames column c stays empty before its next drop: exponential with mean
+   IDLE_MEAN, keyed like the drop parameters so seeking reproduces it */
+static uint64_t idle_delay(int c, const struct column *col) {
+  if (IDLE_MEAN <= 0.0) return 0;
+  uint64_t h = mix64(RNG_KEY ^ 0x9e6c63d0676a9a99ull ^
+                     ((uint64_t)(uint32_t)c << 32 | col->spawned));
+  double u = ((double)(h >> 11) + 0.5) / 9007199254740992.0; /* (0, 1) */
+  return (uint64_t)(-log(u) * IDLE_MEAN);
 }
 
-static inline void pick_lifespan_for_column(struct blue_pill *col, int rows) {
+static inline void pick_lifespan_for_column(struct blue_pill *col, int rows, uint64_t h) {
   int min_len = (int)(rows * 0.30f);
   int max_len = (int)(rows * 0.90f);
   if (min_len < 1)  min_len = 1;
   if (max_len < min_len) max_len = min_len;
-  col->lifespan = rand_range(min_len, max_len);
+  col->lifespan = min_len + (int)(h % (uint64_t)(max_len - min_len + 1));
+}
+
+/* start a new drop at the top of column c at frame f (no-op when the pool
+   is empty). Its parameters hash from (seed, column, drop number), so a
+   column's drops do not depend on the order columns are visited in. */
+static void spawn_drop(int c, int rows, uint64_t f) {
+  int i = pool_free;
+  if (i < 0) return;
+  struct column *col = &matrix[c];
+  struct blue_pill *d = &pool[i];
+  pool_free = d->next;
+
+  uint64_t h = mix64(RNG_KEY ^ 0xd1b54a32d192ed03ull ^
+                     ((uint64_t)(uint32_t)c << 32 | col->spawned++));
+  d->speed = ((hash_unit(mix64(h + 1)) + 0.1f) / 2.0f) * OPT.speed;
+  d->cycle = 0.0f; /* start at top */
+  d->born  = f;
+  pick_lifespan_for_column(d, rows, mix64(h + 2));
+  d->bold = (mix64(h + 3) % 100 > 60);
+
+  d->next = col->drops;
+  col->drops = i;
+  col->count++;
+  pool_used++;
+
+  /* with more than one drop per column, space them about evenly over the
+     head's travel (rows + mean trail of 0.6 rows) */
+  float s = 1.6f * (float)rows / (float)OPT.density;
+  col->spacing = s * (0.5f + hash_unit(mix64(h + 4)));
+}
+
+static void release_drop(int i) {
+  pool[i].next = pool_free;
+  pool_free = i;
+  pool_used--;
+}
+
+/* ---- scheduler ---- */
+static void sched_push(int c) {
+  int i = sched_len++;
+  uint64_t due = matrix[c].due;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (matrix[sched_heap[parent]].due <= due) break;
+    sched_heap[i] = sched_heap[parent];
+    i = parent;
+  }
+  sched_heap[i] = c;
+}
+
+static int sched_pop(void) {
+  int top = sched_heap[0];
+  int last = sched_heap[--sched_len];
+  uint64_t due = matrix[last].due;
+  int i = 0;
+  for (;;) {
+    int child = 2 * i + 1;
+    if (child >= sched_len) break;
+    if (child + 1 < sched_len && matrix[sched_heap[child + 1]].due < matrix[sched_heap[child]].due)
+      child++;
+    if (matrix[sched_heap[child]].due >= due) break;
+    sched_heap[i] = sched_heap[child];
+    i = child;
+  }
+  if (sched_len > 0) sched_heap[i] = last;
+  return top;
+}
+
+/* make every column due at frame f */
+static void sched_reset(uint64_t f) {
+  sched_len = 0;
+  due_count = 0;
+  for (int c = 0; c < COLS; c++) {
+    matrix[c].due = f;
+    sched_push(c);
+  }
+}
+
+/* first frame at which anything visible changes */
+static inline uint64_t sched_due(void) {
+  return sched_len > 0 ? matrix[sched_heap[0]].due : UINT64_MAX;
+}
+
+/* head position of a drop at frame f */
+static inline float drop_cycle(const struct blue_pill *d, uint64_t f) {
+  return (float)(f - d->born) * d->speed;
+}
+
+/* first frame after f at which the drop's head reaches 'target' */
+static uint64_t drop_frame_at(const struct blue_pill *d, uint64_t f, float target) {
+  uint64_t g = d->born + (uint64_t)ceil_int(target / d->speed);
+  if (g <= f) g = f + 1;
+  while (g > f + 1 && drop_cycle(d, g - 1) >= target) g--;
+  while (drop_cycle(d, g) < target) g++;
+  return g;
+}
+
+/* spans depend only on floor(cycle) and on whether cycle is a whole row
+   (all boundaries are cycle + integer), so they next change when the head
+   reaches the next row */
+static uint64_t drop_next_change(const struct blue_pill *d, uint64_t f) {
+  int fl = floor_int(d->cycle);
+  if ((float)fl == d->cycle) return f + 1;
+  return drop_frame_at(d, f, (float)(fl + 1));
+}
+
+/* ---- glyph table ---- */
+/* length of the UTF-8 sequence starting at s, 0 if malformed */
+static int utf8_seq_len(const unsigned char *s) {
+  int n;
+  if (s[0] < 0x80) return 1;
+  else if ((s[0] & 0xE0) == 0xC0) n = 2;
+  else if ((s[0] & 0xF0) == 0xE0) n = 3;
+  else if ((s[0] & 0xF8) == 0xF0) n = 4;
+  else return 0;
+  for (int i = 1; i < n; i++)
+    if ((s[i] & 0xC0) != 0x80) return 0;
+  return n;
+}
+
+/* Vose's construction of the alias table for weights w (NULL: uniform) */
+static int build_alias(const double *w, int n) {
+  uint32_t *prob = (uint32_t *)malloc((size_t)n * sizeof(*prob));
+  uint16_t *alias = (uint16_t *)malloc((size_t)n * sizeof(*alias));
+  double *p = (double *)malloc((size_t)n * sizeof(*p));
+  int *small = (int *)malloc((size_t)n * sizeof(int));
+  int *large = (int *)malloc((size_t)n * sizeof(int));
+  if (!prob || !alias || !p || !small || !large) {
+    free(prob); free(alias); free(p); free(small); free(large);
+    return -1;
+  }
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) sum += w ? w[i] : 1.0;
+  int ns = 0, nl = 0;
+  for (int i = 0; i < n; i++) {
+    p[i] = (w ? w[i] : 1.0) * (double)n / sum; /* mean 1 */
+    if (p[i] < 1.0) small[ns++] = i; else large[nl++] = i;
+  }
+  for (int i = 0; i < n; i++) { prob[i] = UINT32_MAX; alias[i] = (uint16_t)i; }
+  while (ns > 0 && nl > 0) {
+    int s = small[--ns], l = large[nl - 1];
+    prob[s] = (uint32_t)(p[s] * 4294967296.0);
+    alias[s] = (uint16_t)l;
+    p[l] -= 1.0 - p[s];
+    if (p[l] < 1.0) { nl--; small[ns++] = l; }
+  }
+  /* what is left is 1 up to rounding: always kept (the UINT32_MAX above) */
+  free(p); free(small); free(large);
+  free(GLYPH_PROB); free(GLYPH_ALIAS);
+  GLYPH_PROB = prob;
+  GLYPH_ALIAS = alias;
+  return 0;
+}
+
+/* glyphs from a UTF-8 string, w[k] weighting the k-th one (NULL: uniform) */
+static int load_glyphs(const char *chars, const double *w) {
+  const unsigned char *s = (const unsigned char *)chars;
+  int count = 0;
+  for (size_t i = 0; s[i]; ) {
+    int n = utf8_seq_len(s + i);
+    if (n == 0) return -1;
+    if (s[i] >= 0x20 && s[i] != 0x7F) count++; /* skip control chars */
+    i += (size_t)n;
+  }
+  if (count == 0 || count > MAX_GLYPHS) return -1;
+
+  Glyph *g = (Glyph *)calloc((size_t)count, sizeof(Glyph));
+  char (*pairs)[8] = calloc((size_t)count, sizeof(*pairs));
+  if (!g || !pairs) { free(g); free(pairs); return -1; }
+  int k = 0;
+  for (size_t i = 0; s[i]; ) {
+    int n = utf8_seq_len(s + i);
+    if (s[i] >= 0x20 && s[i] != 0x7F) {
+      memcpy(g[k].utf8, s + i, (size_t)n);
+      g[k].len = (uint8_t)n;
+      memcpy(pairs[k], s + i, (size_t)n);
+      pairs[k][n] = ' ';
+      k++;
+    }
+    i += (size_t)n;
+  }
+  if (build_alias(w, count) != 0) { free(g); free(pairs); return -1; }
+  free(GLYPHS);
+  free(GLYPH_PAIRS);
+  GLYPHS = g;
+  GLYPH_PAIRS = pairs;
+  GLYPH_COUNT = count;
+  return 0;
+}
+
+/* "W:GLYPHS" groups separated by white space, '#' to the end of a line is a
+   comment: each glyph of a group gets weight W (> 0). The glyphs go to
+   *chars, one weight per glyph to *w; returns the glyph count or -1. */
+static int parse_weights(const char *spec, char **chars, double **w) {
+  size_t len = strlen(spec);
+  char *out = (char *)malloc(len + 1);
+  double *wt = (double *)malloc((len + 1) * sizeof(double));
+  if (!out || !wt) { free(out); free(wt); return -1; }
+  const unsigned char *s = (const unsigned char *)spec;
+  size_t o = 0;
+  int n = 0;
+  for (size_t i = 0; s[i]; ) {
+    if (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r') { i++; continue; }
+    if (s[i] == '#') { while (s[i] && s[i] != '\n') i++; continue; }
+    char *end;
+    double x = strtod((const char *)s + i, &end);
+    if ((const unsigned char *)end == s + i || *end != ':' || !(x > 0.0 && x < 1e12)) goto bad;
+    i = (size_t)((const unsigned char *)end - s) + 1;
+    int group = 0;
+    while (s[i] && s[i] != ' ' && s[i] != '\t' && s[i] != '\n' && s[i] != '\r') {
+      int k = utf8_seq_len(s + i);
+      if (k == 0) goto bad;
+      if (s[i] >= 0x20 && s[i] != 0x7F) {
+        memcpy(out + o, s + i, (size_t)k);
+        o += (size_t)k;
+        wt[n++] = x;
+        group++;
+      }
+      i += (size_t)k;
+    }
+    if (group == 0) goto bad;
+  }
+  out[o] = 0;
+  *chars = out;
+  *w = wt;
+  return n;
+bad:
+  free(out); free(wt);
+  return -1;
+}
+
+static int load_weighted(const char *spec) {
+  char *chars;
+  double *w;
+  if (parse_weights(spec, &chars, &w) <= 0) return -1;
+  int rc = load_glyphs(chars, w);
+  free(chars); free(w);
+  return rc;
+}
+
+static char *read_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  size_t cap = 4096, len = 0;
+  char *buf = (char *)malloc(cap);
+  while (buf) {
+    len += fread(buf + len, 1, cap - len - 1, f);
+    if (len < cap - 1 || cap >= (1u << 24)) break;
+    char *nb = (char *)realloc(buf, cap * 2);
+    if (!nb) { free(buf); buf = NULL; break; }
+    buf = nb;
+    cap *= 2;
+  }
+  if (buf && ferror(f)) { free(buf); buf = NULL; }
+  fclose(f);
+  if (buf) buf[len] = 0;
+  return buf;
+}
+
+static int init_glyphs(void) {
+  if (OPT.glyph_file) {
+    char *spec = read_file(OPT.glyph_file);
+    if (!spec) return -1;
+    glyph_set_name = "weighted";
+    int rc = load_weighted(spec);
+    free(spec);
+    return rc;
+  }
+  if (OPT.weights) {
+    glyph_set_name = "weighted";
+    return load_weighted(OPT.weights);
+  }
+  if (OPT.chars) {
+    glyph_set_name = "custom";
+    return load_glyphs(OPT.chars, NULL);
+  }
+  for (size_t i = 0; i < sizeof(GLYPH_SETS) / sizeof(GLYPH_SETS[0]); i++) {
+    if (strcmp(GLYPH_SETS[i].name, OPT.glyphs) == 0) {
+      glyph_set_name = GLYPH_SETS[i].name;
+      return load_glyphs(GLYPH_SETS[i].chars, NULL);
+    }
+  }
+  return -1;
 }
 
 /* ---- terminal size ---- */
@@ -97,7 +777,10 @@ static int tty_winsize(struct winsize *w) {
 
 static void get_term_size_now(int *out_cols, int *out_rows) {
   struct winsize w;
-  if (tty_winsize(&w) == -1) {
+  if (OPT.fixed_cols > 0) {
+    PHYS_COLS = OPT.fixed_cols;
+    PHYS_ROWS = OPT.fixed_rows;
+  } else if (tty_winsize(&w) == -1) {
     PHYS_COLS = 80;
     PHYS_ROWS = 24;
   } else {
@@ -109,67 +792,625 @@ static void get_term_size_now(int *out_cols, int *out_rows) {
   *out_rows = PHYS_ROWS;
 }
 
+/* ---- tiled canvas ---- */
+static void canvas_free(void) {
+  for (size_t k = 0; k < tile_nchunks; k++) free(tile_chunks[k]);
+  free(tile_chunks); tile_chunks = NULL;
+  tile_nchunks = tile_chunks_cap = tile_reserved = 0;
+  tile_free = NULL;
+  free(tiles);    tiles    = NULL;
+  free(dirty_l1); dirty_l1 = NULL;
+  free(dirty_l0); dirty_l0 = NULL;
+  TILES_X = TILES_Y = 0;
+  tiles_live = tiles_total = 0;
+}
+
+static int canvas_alloc(int cols, int rows) {
+  int tx = (cols + TILE_W - 1) >> TILE_SHIFT_X;
+  int ty = (rows + TILE_H - 1) >> TILE_SHIFT_Y;
+  size_t n = (size_t)tx * (size_t)ty;
+  size_t w1 = (n + 63) / 64;
+  size_t w0 = (w1 + 63) / 64;
+
+  size_t nc = (n + TILE_CHUNK - 1) / TILE_CHUNK;
+
+  Tile **dir = (Tile **)calloc(n, sizeof(Tile *));
+  uint64_t *l1 = (uint64_t *)calloc(w1, sizeof(uint64_t));
+  uint64_t *l0 = (uint64_t *)calloc(w0, sizeof(uint64_t));
+  Tile **ch = (Tile **)malloc(nc * sizeof(Tile *));
+  if (!dir || !l1 || !l0 || !ch) { free(dir); free(l1); free(l0); free(ch); return -1; }
+
+  canvas_free();
+  tile_chunks = ch;
+  tile_chunks_cap = nc;
+  /* reserve what fits under TILE_RESERVE (and in memory); the pages are
+     only backed once a tile is first used */
+  size_t want = TILE_RESERVE / (TILE_CHUNK * sizeof(Tile));
+  while (tile_nchunks < nc && tile_nchunks < want) {
+    Tile *c = (Tile *)malloc(TILE_CHUNK * sizeof(Tile));
+    if (!c) break;
+    tile_chunks[tile_nchunks++] = c;
+  }
+  tile_reserved = tile_nchunks;
+  tiles = dir; dirty_l1 = l1; dirty_l0 = l0;
+  dirty_l1_words = w1; dirty_l0_words = w0;
+  TILES_X = tx; TILES_Y = ty;
+  return 0;
+}
+
+static Tile *tile_acquire(size_t ti) {
+  Tile *t = tile_free;
+  if (t) {
+    tile_free = t->next_free;
+  } else {
+    size_t k = tiles_total / TILE_CHUNK;
+    if (k == tile_nchunks) {
+      /* past the reserve: one more chunk, a heap call mid-frame */
+      Tile *c = k < tile_chunks_cap ? (Tile *)malloc(TILE_CHUNK * sizeof(Tile)) : NULL;
+      if (!c) return NULL;
+      tile_chunks[tile_nchunks++] = c;
+    }
+    t = &tile_chunks[k][tiles_total % TILE_CHUNK];
+    tiles_total++;
+  }
+  /* fresh tiles are blank and were blank on screen */
+  memset(t->cur,  0, sizeof(t->cur));
+  memset(t->prev, 0, sizeof(t->prev));
+  t->live = 0;
+  t->dirty_rows = 0;
+  t->next_free = NULL;
+  tiles[ti] = t;
+  tiles_live++;
+  return t;
+}
+
+static void tile_release(size_t ti) {
+  Tile *t = tiles[ti];
+  tiles[ti] = NULL;
+  t->next_free = tile_free;
+  tile_free = t;
+  tiles_live--;
+}
+
+static inline void tile_mark(size_t ti, Tile *t, int tile_row) {
+  t->dirty_rows |= (uint16_t)(1u << tile_row);
+  dirty_l1[ti >> 6] |= 1ull << (ti & 63);
+  dirty_l0[ti >> 12] |= 1ull << ((ti >> 6) & 63);
+}
+
+static inline size_t tile_index(int c, int r) {
+  return (size_t)(r >> TILE_SHIFT_Y) * (size_t)TILES_X + (size_t)(c >> TILE_SHIFT_X);
+}
+
+static inline int tile_slot(int c, int r) {
+  return ((r & (TILE_H - 1)) << TILE_SHIFT_X) | (c & (TILE_W - 1));
+}
+
+/* set the style of canvas cell (c, r); a cell that becomes visible gets a
+   fresh random glyph, one that stays visible keeps its glyph */
+static void canvas_set_style(int c, int r, uint8_t style) {
+  size_t ti = tile_index(c, r);
+  Tile *t = tiles[ti];
+  if (!t) {
+    if (style == 0) return;
+    t = tile_acquire(ti);
+    if (!t) return;
+  }
+  Cell *cell = &t->cur[tile_slot(c, r)];
+  if (cell->style == style) return;
+  if (cell->style == 0) { cell->glyph = rand_glyph(); t->live++; }
+  else if (style == 0)  { t->live--; }
+  cell->style = style;
+  tile_mark(ti, t, r & (TILE_H - 1));
+}
+
+/* give a visible cell a new random glyph */
+static void canvas_flicker(int c, int r) {
+  size_t ti = tile_index(c, r);
+  Tile *t = tiles[ti];
+  if (!t) return;
+  Cell *cell = &t->cur[tile_slot(c, r)];
+  if (cell->style == 0) return;
+  cell->glyph = rand_glyph();
+  tile_mark(ti, t, r & (TILE_H - 1));
+}
+
+/* mark every allocated tile under the viewport as fully dirty */
+static void canvas_mark_viewport(void) {
+  if (VIEW_COLS <= 0 || VIEW_ROWS <= 0) return;
+  int tx0 = VIEW_X >> TILE_SHIFT_X, tx1 = (VIEW_X + VIEW_COLS - 1) >> TILE_SHIFT_X;
+  int ty0 = VIEW_Y >> TILE_SHIFT_Y, ty1 = (VIEW_Y + VIEW_ROWS - 1) >> TILE_SHIFT_Y;
+  for (int ty = ty0; ty <= ty1; ty++) {
+    for (int tx = tx0; tx <= tx1; tx++) {
+      size_t ti = (size_t)ty * (size_t)TILES_X + (size_t)tx;
+      Tile *t = tiles[ti];
+      if (!t) continue;
+      for (int tr = 0; tr < TILE_H; tr++) tile_mark(ti, t, tr);
+    }
+  }
+}
+
+/* after encoding: sync prev for dirty rows, clear the bitmaps and recycle
+   tiles that went fully blank; cost is proportional to dirty tiles only */
+static void canvas_settle(void) {
+  for (size_t w0 = 0; w0 < dirty_l0_words; w0++) {
+    uint64_t bits0 = dirty_l0[w0];
+    dirty_l0[w0] = 0;
+    while (bits0) {
+      size_t w1 = w0 * 64 + (size_t)__builtin_ctzll(bits0);
+      bits0 &= bits0 - 1;
+      uint64_t bits1 = dirty_l1[w1];
+      dirty_l1[w1] = 0;
+      while (bits1) {
+        size_t ti = w1 * 64 + (size_t)__builtin_ctzll(bits1);
+        bits1 &= bits1 - 1;
+        Tile *t = tiles[ti];
+        if (!t) continue;
+        if (t->live == 0) { tile_release(ti); continue; }
+        for (int tr = 0; tr < TILE_H; tr++) {
+          if (!(t->dirty_rows & (1u << tr))) continue;
+          memcpy(&t->prev[tr << TILE_SHIFT_X], &t->cur[tr << TILE_SHIFT_X], TILE_W * sizeof(Cell));
+        }
+        t->dirty_rows = 0;
+      }
+    }
+  }
+}
+
+/* ---- terminal mode ---- */
+/* with --focus, stdin is put in raw mode (no echo, reads return at once)
+   and the terminal reports focus changes as CSI I / CSI O */
+static struct termios tty_saved;
+static int tty_raw = 0;
+static int focused = 1;
+static int focus_parse = 0; /* bytes of CSI I / CSI O matched so far */
+
+static void tty_enter(void) {
+  const char *seq = "\x1b[?25l\x1b[H"; /* hide cursor & home */
+  write(1, seq, (size_t)strlen(seq));
+  if (!OPT.focus || !isatty(0)) return;
+  if (!tty_raw) {
+    if (tcgetattr(0, &tty_saved) != 0) return;
+    tty_raw = 1;
+  }
+  struct termios t = tty_saved;
+  t.c_lflag &= ~(tcflag_t)(ICANON | ECHO);
+  t.c_cc[VMIN] = 0;
+  t.c_cc[VTIME] = 0;
+  tcsetattr(0, TCSANOW, &t);
+  seq = "\x1b[?1004h";
+  write(1, seq, (size_t)strlen(seq));
+}
+
+static void tty_leave(void) {
+  if (OPT.fall) write(1, "\x1b[r", 3); /* full-screen scroll region */
+  const char *seq = tty_raw ? "\x1b[?1004l\x1b[?25h\x1b[H" : "\x1b[?25h\x1b[H";
+  write(1, seq, (size_t)strlen(seq)); /* show cursor & home */
+  if (tty_raw) tcsetattr(0, TCSANOW, &tty_saved);
+}
+
+/* consume pending input, tracking focus reports; other keys are ignored.
+   Returns 1 when focus came back. */
+static int read_focus(void) {
+  char buf[64];
+  ssize_t n;
+  int was = focused;
+  if (!tty_raw) return 0;
+  while ((n = read(0, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      char ch = buf[i];
+      if (focus_parse == 0) focus_parse = ch == 0x1b;
+      else if (focus_parse == 1) focus_parse = ch == '[' ? 2 : ch == 0x1b;
+      else {
+        if (ch == 'I') focused = 1;
+        else if (ch == 'O') focused = 0;
+        focus_parse = ch == 0x1b;
+      }
+    }
+  }
+  return focused && !was;
+}
+
+/* ---- shared memory export ---- */
+/* --shm NAME publishes the viewport as a grid to /NAME for local readers.
+   Layout: a shm_header, then rows * cols shm_cells (row-major) at
+   cells_offset, then glyph_count shm_glyphs at glyphs_offset. Everything
+   after 'seq' is guarded by a seqlock: seq is odd while an update is in
+   progress. A reader copies what it needs between two acquire loads of
+   seq and retries unless both are the same even value. The writer never
+   waits. The segment only grows, so a mapping of 'bytes' stays valid. */
+#define SHM_MAGIC 0x58525443u /* "CTRX" */
+#define SHM_VERSION 1u
+
+struct shm_header {
+  uint32_t magic, version;
+  _Atomic uint64_t seq;
+  uint64_t frame;          /* simulation frame of this state */
+  uint32_t cols, rows;     /* viewport cells (each 2 terminal columns wide) */
+  uint32_t cells_offset, glyphs_offset;
+  uint32_t glyph_count;
+  uint32_t bytes;          /* size of the segment in use */
+};
+
+struct shm_cell {
+  uint16_t glyph;  /* index into the glyph table (meaningless when blank) */
+  uint8_t  style;  /* 0 blank, 1-3 trail, 4 neck, 5 head, 6+ gradient shades */
+  uint8_t  pad;
+};
+
+struct shm_glyph {
+  char    utf8[4];
+  uint8_t len;
+  uint8_t pad[3];
+};
+
+static struct shm_header *SHM = NULL;
+static size_t shm_mapped = 0;
+static int shm_fd = -1;
+
+static int shm_init(void) {
+  char name[256];
+  snprintf(name, sizeof(name), "/%s", OPT.shm[0] == '/' ? OPT.shm + 1 : OPT.shm);
+  shm_fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  return shm_fd < 0 ? -1 : 0;
+}
+
+static void shm_close(void) {
+  if (SHM) munmap(SHM, shm_mapped);
+  SHM = NULL;
+  if (shm_fd >= 0) {
+    char name[256];
+    snprintf(name, sizeof(name), "/%s", OPT.shm[0] == '/' ? OPT.shm + 1 : OPT.shm);
+    close(shm_fd);
+    shm_unlink(name);
+    shm_fd = -1;
+  }
+}
+
+/* ---- stats socket ---- */
+/* --stats-sock: each client that connects gets one JSON snapshot of the
+   live counters and is closed. The listener is non-blocking and polled
+   once per loop, between frames, so the snapshot is consistent without
+   locks and a slow client never stalls a frame. */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 /* SO_NOSIGPIPE is set instead */
+#endif
+#define STATS_RING 512 /* frames kept for rates and percentiles */
+
+static int stats_fd = -1;
+static uint64_t stats_t0 = 0;           /* when the socket was opened */
+static struct {
+  uint64_t at[STATS_RING];              /* start of each sent frame, ns */
+  uint32_t work_ns[STATS_RING];         /* start to write done */
+  uint32_t bytes[STATS_RING];
+  uint64_t n;                           /* frames recorded so far */
+} FTIMES;
+
+static int stats_open(void) {
+  struct sockaddr_un sa;
+  struct stat st;
+  if (strlen(OPT.stats_sock) >= sizeof(sa.sun_path)) return -1;
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, OPT.stats_sock);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  /* a socket left by an earlier run is replaced; a live one or anything
+     that is not a socket is not */
+  if (lstat(sa.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0) {
+      close(fd);
+      errno = EADDRINUSE;
+      return -1;
+    }
+    close(fd);
+    unlink(sa.sun_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 8) != 0) {
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  stats_fd = fd;
+  return 0;
+}
+
+static void stats_close(void) {
+  if (stats_fd < 0) return;
+  close(stats_fd);
+  unlink(OPT.stats_sock);
+  stats_fd = -1;
+}
+
+/* record a sent frame that started at t0 and finished writing at t1 */
+static inline void stats_frame(uint64_t t0, uint64_t t1, size_t len) {
+  size_t i = (size_t)(FTIMES.n++ % STATS_RING);
+  FTIMES.at[i] = t0;
+  FTIMES.work_ns[i] = (uint32_t)(t1 - t0 < UINT32_MAX ? t1 - t0 : UINT32_MAX);
+  FTIMES.bytes[i] = (uint32_t)(len < UINT32_MAX ? len : UINT32_MAX);
+}
+
+/* the snapshot's format; none of its STATS_FIELDS conversions prints more
+   than 20 characters (a 64-bit counter; the doubles are smaller) */
+#define STATS_FMT \
+  "{\"frame\":%llu,\"uptime_s\":%.1f,\"fps\":%llu,\"bytes_per_s\":%llu," \
+  "\"frame_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f,\"frames\":%d}," \
+  "\"frames_sent\":%llu,\"frames_skipped\":%llu,\"frames_dropped\":%llu," \
+  "\"bytes_total\":%llu,\"cols\":%d,\"rows\":%d,\"drops\":%d,\"quality_level\":%d}\n"
+#define STATS_FIELDS 17
+#define STATS_JSON_MAX (sizeof(STATS_FMT) + STATS_FIELDS * 20)
+
+/* the snapshot: sent frames and bytes over the last second, frame work
+   time percentiles over the last STATS_RING frames; -1 if it did not fit */
+static int stats_json(char *buf, size_t cap, uint64_t now) {
+  uint32_t t[STATS_RING];
+  int n = (int)(FTIMES.n < STATS_RING ? FTIMES.n : STATS_RING);
+  uint64_t fps = 0, bps = 0;
+  for (int i = 0; i < n; i++) {
+    t[i] = FTIMES.work_ns[i];
+    if (now - FTIMES.at[i] <= NSEC_PER_SEC) { fps++; bps += FTIMES.bytes[i]; }
+  }
+  for (int gap = n / 2; gap > 0; gap /= 2) /* shell sort: no heap, no recursion */
+    for (int i = gap; i < n; i++) {
+      uint32_t v = t[i];
+      int j = i;
+      for (; j >= gap && t[j - gap] > v; j -= gap) t[j] = t[j - gap];
+      t[j] = v;
+    }
+#define PCT(p) (n ? (double)t[(n - 1) * (p) / 100] / 1000.0 : 0.0)
+  int len = snprintf(buf, cap, STATS_FMT,
+    (unsigned long long)FRAME, (double)(now - stats_t0) / 1e9,
+    (unsigned long long)fps, (unsigned long long)bps,
+    PCT(50), PCT(90), PCT(99), PCT(100), n,
+    (unsigned long long)STATS.frames, (unsigned long long)STATS.skipped,
+    (unsigned long long)Q.dropped, (unsigned long long)STATS.bytes,
+    PHYS_COLS, PHYS_ROWS, pool_used, Q.level);
+#undef PCT
+  return len < 0 || (size_t)len >= cap ? -1 : len;
+}
+
+/* answer every client waiting on the listener */
+static void stats_serve(uint64_t now) {
+  for (;;) {
+    int c = accept(stats_fd, NULL, NULL);
+    if (c < 0) return;
+    char buf[STATS_JSON_MAX];
+    int len = stats_json(buf, sizeof(buf), now);
+    if (len < 0) {
+      /* the bound above is wrong: say so rather than close on the client */
+      static const char err[] = "{\"error\":\"snapshot truncated\"}\n";
+      memcpy(buf, err, sizeof(err));
+      len = (int)sizeof(err) - 1;
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(c, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    (void)send(c, buf, (size_t)len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(c);
+  }
+}
+
 /* ---- cleanup ---- */
 static void cleanup(void) {
-  if (matrix) {
-    for (int i = 0; i < COLS; i++) free(matrix[i].rsi);
-    free(matrix);
-  }
-  free(prev_grid); prev_grid = NULL;
-  free(cur_grid);  cur_grid  = NULL;
+  free(matrix);    matrix    = NULL;
+  free(pool);      pool      = NULL;
+  free(col_spans); col_spans = NULL;
+  free(span_new);  span_new  = NULL;
+  free(span_raw);  span_raw  = NULL;
+  free(sched_heap); sched_heap = NULL;
+  free(due_cols);  due_cols  = NULL;
+  canvas_free();
   free(outbuf);    outbuf    = NULL;
-  /* show cursor & home */
-  const char *seq = "\x1b[?25h\x1b[H";
-  write(1, seq, (size_t)strlen(seq));
+  free(out_iov);   out_iov   = NULL;
+  free(row_runs);  row_runs  = NULL;
+  free(row_scratch); row_scratch = NULL;
+  free(view_glyphs); view_glyphs = NULL;
+  free(view_epoch); view_epoch = NULL;
+  free(chg);       chg       = NULL;
+  free(chg_tmp);   chg_tmp   = NULL;
+  free(chg_mark);  chg_mark  = NULL;
+  free(fall_ring); fall_ring = NULL;
+  free(fall_row);  fall_row  = NULL;
+  free(fall_cols); fall_cols = NULL;
+  if (OPT.shm) shm_close();
+  if (OPT.stats_sock) stats_close();
+  free(GLYPHS);    GLYPHS    = NULL;
+  free(GLYPH_PAIRS); GLYPH_PAIRS = NULL;
+  free(GLYPH_PROB); GLYPH_PROB = NULL;
+  free(GLYPH_ALIAS); GLYPH_ALIAS = NULL;
+  if (OPT.bench > 0) return;
+  tty_leave();
 }
 
 /* ---- signals ---- */
 static void handle_winch(int sig) { (void)sig; resize_pending = 1; }
 static void handle_exit_signal(int sig) { (void)sig; exit_pending = 1; }
+static void handle_tstp(int sig) { (void)sig; suspend_pending = 1; }
+static void handle_cont(int sig) { (void)sig; resume_pending = 1; }
+
+/* install h for good: under strict POSIX feature macros glibc's signal()
+   is one-shot, which left every SIGWINCH after the first unseen. Sleeps
+   always end early; a blocked write carries on with SA_RESTART in flags
+   and gives up without it, so an exit signal gets past a stalled terminal */
+static void on_signal(int sig, void (*h)(int), int flags) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = h;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = flags;
+  sigaction(sig, &sa, NULL);
+}
 
 /* ---- allocation ---- */
-static struct blue_pill *alloc_matrix(int cols, int rows) {
-  struct blue_pill *m = (struct blue_pill *)malloc((size_t)cols * sizeof(*m));
-  if (!m) return NULL;
+/* columns, drop pool and span storage; every column starts one drop */
+static int alloc_matrix(int cols, int rows) {
+  int cap = cols * OPT.density;
+  /* merged runs of 5 spans per drop, or gradient shades + 2 */
+  int span_cap = 2 * ((OPT.gradient ? OPT.gradient : 3) + 2) * OPT.density + 1;
+  struct column *m = (struct column *)malloc((size_t)cols * sizeof(*m));
+  struct blue_pill *p = (struct blue_pill *)malloc((size_t)cap * sizeof(*p));
+  struct span *cs = (struct span *)malloc((size_t)cols * (size_t)span_cap * sizeof(*cs));
+  struct span *sn = (struct span *)malloc((size_t)span_cap * sizeof(*sn));
+  struct span *sr = (struct span *)malloc((size_t)span_cap * sizeof(*sr));
+  int *sh = (int *)malloc((size_t)cols * sizeof(int));
+  int *dc = (int *)malloc((size_t)cols * sizeof(int));
+  if (!m || !p || !cs || !sn || !sr || !sh || !dc) {
+    free(m); free(p); free(cs); free(sn); free(sr); free(sh); free(dc);
+    return -1;
+  }
+  free(matrix); free(pool); free(col_spans); free(span_new); free(span_raw);
+  free(sched_heap); free(due_cols);
+  matrix = m; pool = p; col_spans = cs; span_new = sn; span_raw = sr;
+  sched_heap = sh; due_cols = dc;
+  SPAN_CAP = span_cap;
+
+  pool_cap = cap;
+  pool_used = 0;
+  pool_free = -1;
+  for (int i = cap - 1; i >= 0; i--) { pool[i].next = pool_free; pool_free = i; }
+
+  /* a drop lives about 1.6 rows / 0.3 speed frames; idle for s of the time */
+  IDLE_MEAN = 1.6 * (double)rows / (0.3 * (double)OPT.speed) * OPT.sparsity / (1.0 - OPT.sparsity);
+
+  sched_len = 0;
+  due_count = 0;
   for (int c = 0; c < cols; c++) {
-    m[c].rsi = (char *)malloc((size_t)rows);
-    if (!m[c].rsi) {
-      for (int k = 0; k < c; k++) free(m[k].rsi);
-      free(m);
-      return NULL;
-    }
-    m[c].speed = ((((float)rand() / (float)RAND_MAX) + 0.1f) / 2.0f);
-    m[c].cycle = 0.0f; /* start at top */
-    pick_lifespan_for_column(&m[c], rows);
-    for (int r = 0; r < rows; r++) m[c].rsi[r] = CHARS[rand() % chars_len()];
-    m[c].bold = (rand() % 100 > 60);
+    matrix[c].drops = -1;
+    matrix[c].count = 0;
+    matrix[c].nspans = 0; /* a head at cycle 0 covers no rows */
+    matrix[c].visible = 0;
+    matrix[c].flick_at = HUGE_VAL;
+    matrix[c].due = FRAME;
+    matrix[c].spawned = 0;
+    matrix[c].wake = FRAME + idle_delay(c, &matrix[c]); /* staggered start */
+    if (matrix[c].wake <= FRAME) spawn_drop(c, rows, FRAME);
+    sched_push(c);
   }
-  return m;
+  return 0;
 }
 
-/* ensure grids & output buffer sizes */
+/* grow the change list (and its sort scratch) to hold cap cells */
+static int chg_reserve(int cap) {
+  if (cap <= chg_cap) return 0;
+  struct cell_ref *a = (struct cell_ref *)realloc(chg, (size_t)cap * sizeof(*a));
+  if (a) chg = a;
+  struct cell_ref *b = (struct cell_ref *)realloc(chg_tmp, (size_t)cap * sizeof(*b));
+  if (b) chg_tmp = b;
+  if (!a || !b) return -1;
+  chg_cap = cap;
+  return 0;
+}
+
+/* output buffer sized for the viewport, not the canvas */
 static int ensure_buffers(int cols, int rows) {
   size_t cells = (size_t)cols * (size_t)rows;
-  if (cells > grid_cap_cells) {
-    Cell *pg = (Cell *)realloc(prev_grid, cells * sizeof(Cell));
-    Cell *cg = (Cell *)realloc(cur_grid,  cells * sizeof(Cell));
-    if (!pg || !cg) { free(pg); free(cg); return -1; }
-    prev_grid = pg;
-    cur_grid  = cg;
-    grid_cap_cells = cells;
-    /* poison prev so first diff draws full */
-    memset(prev_grid, 0xFF, cells * sizeof(Cell));
-  }
-  /* worst-case diff (move+SGR per cell) budget */
+  /* worst-case diff (move+SGR+4-byte glyph per cell) budget */
   size_t need = cells * 64u + 4096u;
   if (need > out_cap) {
     char *nb = (char *)realloc(outbuf, need);
     if (!nb) return -1;
     outbuf = nb; out_cap = need;
   }
+  if (OPT.output != OUT_COPY && (size_t)iov_cap < 4 * cells + 64) {
+    /* at most move, SGR and glyph per cell, twice over for a row tried
+       both ways */
+    struct iovec *iv = (struct iovec *)realloc(out_iov, (4 * cells + 64) * sizeof(*iv));
+    if (!iv) return -1;
+    out_iov = iv;
+    iov_cap = (int)(4 * cells + 64);
+  }
+  if (cols > row_cap) {
+    struct run *rr = (struct run *)realloc(row_runs, (size_t)cols * sizeof(struct run));
+    if (!rr) return -1;
+    row_runs = rr;
+    char *rs = (char *)realloc(row_scratch, (size_t)cols * 64u + 64u);
+    if (!rs) return -1;
+    row_scratch = rs;
+    row_cap = cols;
+  }
+  if (OPT.spans) {
+    /* the viewport's glyphs (or just their epochs) are all the span
+       renderer keeps per cell */
+    if (OPT.counter_glyphs) {
+      uint32_t *ve = (uint32_t *)realloc(view_epoch, (cells ? cells : 1) * sizeof(uint32_t));
+      if (!ve) return -1;
+      view_epoch = ve;
+      memset(view_epoch, 0, cells * sizeof(uint32_t));
+    } else {
+      uint16_t *vg = (uint16_t *)realloc(view_glyphs, (cells ? cells : 1) * sizeof(uint16_t));
+      if (!vg) return -1;
+      view_glyphs = vg;
+      for (size_t i = 0; i < cells; i++) view_glyphs[i] = rand_glyph();
+    }
+  }
+  if (OPT.fall) {
+    /* a blank screen; streams start staggered over the first rows */
+    Cell *fr = (Cell *)realloc(fall_ring, (cells ? cells : 1) * sizeof(Cell));
+    if (!fr) return -1;
+    fall_ring = fr;
+    Cell *rw = (Cell *)realloc(fall_row, (size_t)(cols ? cols : 1) * sizeof(Cell));
+    if (!rw) return -1;
+    fall_row = rw;
+    struct fall_col *fc = (struct fall_col *)realloc(fall_cols, (size_t)(cols ? cols : 1) * sizeof(*fc));
+    if (!fc) return -1;
+    fall_cols = fc;
+    memset(fall_ring, 0, cells * sizeof(Cell));
+    for (int x = 0; x < cols; x++) {
+      fall_cols[x].left = 0;
+      fall_cols[x].gap = rand() % (rows + 1);
+    }
+    fall_top = fall_pending = fall_live = 0;
+    fall_frame = FRAME;
+    fall_acc = fall_flick = 0.0;
+  }
+  if (OPT.spans || OPT.fall) {
+    /* a cell is on the list at most once, however many frames its changes
+       wait (--max-bps), so a list of one entry per cell never grows */
+    uint8_t *cm = (uint8_t *)realloc(chg_mark, cells ? cells : 1);
+    if (!cm) return -1;
+    chg_mark = cm;
+    memset(chg_mark, 0, cells);
+    chg_count = 0;
+    if (chg_reserve((int)(cells ? cells : 1)) != 0) return -1;
+  }
   return 0;
 }
 
+/* place the viewport (terminal-sized) on the canvas */
+static void set_viewport(int term_cols, int term_rows) {
+  VIEW_X = OPT.view_x / 2;
+  VIEW_Y = OPT.view_y;
+  if (VIEW_X > COLS - 1) VIEW_X = COLS - 1;
+  if (VIEW_Y > ROWS - 1) VIEW_Y = ROWS - 1;
+  if (VIEW_X < 0) VIEW_X = 0;
+  if (VIEW_Y < 0) VIEW_Y = 0;
+  VIEW_COLS = term_cols < COLS - VIEW_X ? term_cols : COLS - VIEW_X;
+  VIEW_ROWS = term_rows < ROWS - VIEW_Y ? term_rows : ROWS - VIEW_Y;
+}
+
+/* (re)build simulation and canvas; canvas follows the terminal unless --canvas */
+static int setup_world(int term_cols, int term_rows) {
+  int cols = term_cols, rows = term_rows;
+  if (OPT.canvas_cols > 0) {
+    cols = (OPT.canvas_cols + 1) / 2;
+    rows = OPT.canvas_rows;
+  }
+  if (!matrix || cols != COLS || rows != ROWS) {
+    if ((!OPT.spans && canvas_alloc(cols, rows) != 0) || alloc_matrix(cols, rows) != 0) {
+      COLS = ROWS = 0;
+      return -1;
+    }
+    COLS = cols;
+    ROWS = rows;
+  }
+  set_viewport(term_cols, term_rows);
+  return ensure_buffers(VIEW_COLS, VIEW_ROWS);
+}
+
 /* resize (called when pending) */
 static int apply_resize_if_needed(int *force_full) {
   if (!resize_pending) return 0;
@@ -178,18 +1419,7 @@ static int apply_resize_if_needed(int *force_full) {
   get_term_size_now(&new_cols, &new_rows);
   if (new_cols <= 0 || new_rows <= 0) { resize_pending = 0; return -1; }
 
-  struct blue_pill *nm = alloc_matrix(new_cols, new_rows);
-  if (!nm) { resize_pending = 0; return -1; }
-
-  if (matrix) {
-    for (int c = 0; c < COLS; c++) free(matrix[c].rsi);
-    free(matrix);
-  }
-  matrix = nm;
-  COLS = new_cols;
-  ROWS = new_rows;
-
-  if (ensure_buffers(COLS, ROWS) != 0) { resize_pending = 0; return -1; }
+  if (setup_world(new_cols, new_rows) != 0) { resize_pending = 0; return -1; }
 
   *force_full = 1; /* repaint all after resize */
   resize_pending = 0;
@@ -199,20 +1429,51 @@ static int apply_resize_if_needed(int *force_full) {
 /* also poll size each frame; some muxers swallow SIGWINCH */
 static inline void poll_resize(void) {
   struct winsize w;
+  if (OPT.fixed_cols > 0) return;
   if (tty_winsize(&w) != 0) return;
-  int phys_cols = (int)w.ws_col;
-  int phys_rows = (int)w.ws_row;
-  int logical_cols = (phys_cols + 1) / 2;
-  int logical_rows = phys_rows;
-  if (logical_cols != COLS || logical_rows != ROWS) resize_pending = 1;
+  if ((int)w.ws_col != PHYS_COLS || (int)w.ws_row != PHYS_ROWS) resize_pending = 1;
+}
+
+/* ---- styles ---- */
+/* nearest level of the 256-colour cube: 0, 95, 135, 175, 215, 255 */
+static int cube_level(int v) {
+  return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40;
+}
+
+/* gradient shades from tail1 green to tail3 green, rendered once; shades
+   that quantise to one colour share a style, so a run only changes colour
+   where the emitted colour does */
+static void init_styles(void) {
+  int n = OPT.truecolor && !OPT.gradient ? 16 : OPT.gradient;
+  OPT.gradient = n;
+  for (int k = 0; k < n; k++) {
+    double t = (double)k / (n - 1);
+    int g = (int)(t < 0.5 ? 95 + 240 * t : 215 + 80 * (t - 0.5));
+    int r = (int)(t < 0.5 ? 0 : 190 * (t - 0.5));
+    char *sgr = GRADIENT_SGR[k];
+    if (OPT.truecolor) snprintf(sgr, sizeof(GRADIENT_SGR[k]), "\x1b[38;2;%d;%d;0m", r, g);
+    else snprintf(sgr, sizeof(GRADIENT_SGR[k]), "\x1b[38;5;%dm", 16 + 36 * cube_level(r) + 6 * cube_level(g));
+    int same = 0;
+    while (strcmp(GRADIENT_SGR[same], sgr) != 0) same++;
+    SGR_MAP[STYLE_GRAD + k] = GRADIENT_SGR[same];
+    STYLE_MAP[0][STYLE_GRAD + k] = (uint8_t)(STYLE_GRAD + same);
+    STYLE_MAP[1][STYLE_GRAD + k] = (uint8_t)(1 + 3 * k / n);
+    STYLE_MAP[2][STYLE_GRAD + k] = 2;
+  }
+  for (int s = 0; s < STYLE_GRAD + n; s++) {
+    int rank = s <= 3 ? s : s >= STYLE_GRAD ? 4 + s - STYLE_GRAD : s + n;
+    STYLE_RANK[s] = (uint8_t)rank;
+    RANK_STYLE[rank] = (uint8_t)s;
+  }
+  RANK_TOP = 5 + n;
 }
 
 /* init */
 static int init_world(void) {
-  get_term_size_now(&COLS, &ROWS);
-  matrix = alloc_matrix(COLS, ROWS);
-  if (!matrix) return -1;
-  return ensure_buffers(COLS, ROWS);
+  int cols, rows;
+  get_term_size_now(&cols, &rows);
+  init_styles();
+  return setup_world(cols, rows);
 }
 
 /* time */
@@ -227,6 +1488,14 @@ static inline void sleep_until(uint64_t target_ns) {
   uint64_t diff = target_ns - now;
   struct timespec ts = { .tv_sec = (time_t)(diff / 1000000000ull),
                          .tv_nsec = (long)(diff % 1000000000ull) };
+  if (tty_raw) {
+    /* wake early on input so a focus report is seen at once */
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(0, &fds);
+    pselect(1, &fds, NULL, NULL, &ts, NULL);
+    return;
+  }
   nanosleep(&ts, NULL);
 }
 
@@ -236,10 +1505,6 @@ static inline void buf_puts(char **p, const char *s) {
   memcpy(*p, s, n);
   *p += n;
 }
-static inline void buf_putc(char **p, char c) {
-  **p = c;
-  (*p)++;
-}
 static inline void buf_move_cursor(char **p, int row1, int col1) {
   /* ESC[row;colH  (1-based) */
   char tmp[32];
@@ -248,167 +1513,1771 @@ static inline void buf_move_cursor(char **p, int row1, int col1) {
   *p += n;
 }
 
-/* build current grid from simulation state */
-static void build_cur_grid(void) {
-  for (int r = 0; r < ROWS; r++) {
-    for (int c = 0; c < COLS; c++) {
-      uint8_t style = 0;
-      if (r - 3 > matrix[c].cycle - matrix[c].lifespan && r < matrix[c].cycle - 2) {
-        style = matrix[c].bold ? 3 : 2;
-      } else if (r - 1 > matrix[c].cycle - matrix[c].lifespan && r < matrix[c].cycle - 2) {
-        style = 2;
-      } else if (r > matrix[c].cycle - matrix[c].lifespan && r < matrix[c].cycle - 2) {
-        style = 1;
-      } else if (matrix[c].cycle > r + 1 && matrix[c].cycle < r + 2) {
-        style = 4;
-      } else if (matrix[c].cycle > r && matrix[c].cycle < r + 1) {
-        style = 5;
-      } else {
-        style = 0;
-      }
+/* append [lo, hi] clipped to the canvas rows; returns spans added */
+static inline int put_span(struct span *out, int lo, int hi, int style) {
+  if (lo < 0) lo = 0;
+  if (hi > ROWS - 1) hi = ROWS - 1;
+  if (lo > hi) return 0;
+  out->lo = lo; out->hi = hi; out->style = STYLE_MAP[Q.depth][style];
+  return 1;
+}
 
-      Cell *cell = &cur_grid[(size_t)r * (size_t)COLS + (size_t)c];
-      if (style == 0) {
-        cell->style = 0; cell->ch = ' ';
-      } else {
-        cell->style = style; cell->ch = matrix[c].rsi[r];
-      }
+/* style runs of one drop, top to bottom: tail1, tail2, tail3, neck, head.
+   A row r is in the trail when r > cycle - lifespan and r < cycle - 2;
+   the neck has cycle - 2 < r < cycle - 1 and the head cycle - 1 < r < cycle.
+   With --gradient the trail is cut into equal shares, one per shade. */
+static int drop_spans(const struct blue_pill *d, struct span *out) {
+  float cy = d->cycle, tail = cy - (float)d->lifespan;
+  int a  = floor_int(tail) + 1;      /* first trail row */
+  int e  = ceil_int(cy - 2) - 1;     /* last trail row */
+  int n = 0;
+  if (OPT.gradient) {
+    int g = OPT.gradient;
+    float step = (float)(d->lifespan - 2) / (float)g;
+    int lo = a;
+    for (int k = 0; k < g; k++) {
+      int next = k + 1 < g ? floor_int(tail + step * (float)(k + 1)) + 1 : e + 1;
+      n += put_span(out + n, lo, (next - 1 < e ? next - 1 : e), STYLE_GRAD + k);
+      if (next > lo) lo = next;
     }
+  } else {
+    int b2 = floor_int(tail + 1) + 1;  /* first tail2 row */
+    int b3 = floor_int(tail + 3) + 1;  /* first tail3 row */
+    n += put_span(out + n, a, (b2 - 1 < e ? b2 - 1 : e), 1);
+    n += put_span(out + n, (a > b2 ? a : b2), (b3 - 1 < e ? b3 - 1 : e), 2);
+    n += put_span(out + n, (a > b3 ? a : b3), e, d->bold ? 3 : 2);
   }
+  n += put_span(out + n, floor_int(cy - 2) + 1, ceil_int(cy - 1) - 1, 4);
+  n += put_span(out + n, floor_int(cy - 1) + 1, ceil_int(cy) - 1, 5);
+  return n;
 }
 
-/* diff renderer: emits only changed runs (grouped by style) */
-static void render_diff(int force_full) {
-  char *ptr = outbuf;
+/* spans of a whole column; overlapping drops resolve to the brighter style */
+static int column_spans(const struct column *col, struct span *out) {
+  if (col->count <= 1)
+    return col->drops < 0 ? 0 : drop_spans(&pool[col->drops], out);
 
+  /* boundary events: +rank at lo, -rank at hi + 1 (in span_raw, then sorted);
+     drops are chained newest (highest) first, so events arrive nearly sorted */
+  struct span *raw = span_raw;
+  int n = 0;
+  for (int i = col->drops; i >= 0; i = pool[i].next) {
+    struct span tmp[GRADIENT_MAX + 2];
+    int k = drop_spans(&pool[i], tmp);
+    for (int j = 0; j < k; j++) {
+      int rank = STYLE_RANK[tmp[j].style];
+      raw[n++] = (struct span){ tmp[j].lo,     0,  rank };
+      raw[n++] = (struct span){ tmp[j].hi + 1, 0, -rank };
+    }
+  }
+  for (int i = 1; i < n; i++) {
+    struct span ev = raw[i];
+    int j = i - 1;
+    while (j >= 0 && raw[j].lo > ev.lo) { raw[j + 1] = raw[j]; j--; }
+    raw[j + 1] = ev;
+  }
+
+  int active[RANK_COUNT];
+  memset(active, 0, (size_t)(RANK_TOP + 1) * sizeof(int));
+  int m = 0;
+  for (int i = 0; i < n; ) {
+    int row = raw[i].lo;
+    for (; i < n && raw[i].lo == row; i++) {
+      if (raw[i].style > 0) active[raw[i].style]++;
+      else active[-raw[i].style]--;
+    }
+    int rank = RANK_TOP;
+    while (rank > 0 && active[rank] == 0) rank--;
+    int style = RANK_STYLE[rank];
+    int end = (i < n) ? raw[i].lo - 1 : ROWS - 1;
+    if (style == 0 || end < row) continue;
+    if (m > 0 && out[m - 1].style == style && out[m - 1].hi == row - 1) out[m - 1].hi = end;
+    else out[m++] = (struct span){ row, end, style };
+  }
+  return m;
+}
+
+/* ---- span renderer ---- */
+static void chg_push(int x, int y) {
+  uint8_t *m = &chg_mark[(size_t)y * (size_t)VIEW_COLS + (size_t)x];
+  if (*m) return;
+  *m = 1;
+  chg[chg_count].x = x;
+  chg[chg_count].y = y;
+  chg_count++;
+}
+
+/* empty the change list */
+static void chg_clear(void) {
+  for (int k = 0; k < chg_count; k++)
+    chg_mark[(size_t)chg[k].y * (size_t)VIEW_COLS + (size_t)chg[k].x] = 0;
+  chg_count = 0;
+}
+
+/* a new glyph for viewport cell (x, y): bump its epoch, or draw one */
+static inline void view_new_glyph(int x, int y) {
+  size_t i = (size_t)y * (size_t)VIEW_COLS + (size_t)x;
+  if (OPT.counter_glyphs) view_epoch[i]++;
+  else view_glyphs[i] = rand_glyph();
+}
+
+/* record rows [r0, r1) of column c as changed; cells that were blank (and
+   flickering ones, passed as so = 0) get a fresh glyph */
+static void view_mark(int c, int r0, int r1, int so) {
+  int x = c - VIEW_X;
+  if (x < 0 || x >= VIEW_COLS) return;
+  if (r0 < VIEW_Y) r0 = VIEW_Y;
+  if (r1 > VIEW_Y + VIEW_ROWS) r1 = VIEW_Y + VIEW_ROWS;
+  for (int r = r0; r < r1; r++) {
+    if (so == 0) view_new_glyph(x, r - VIEW_Y);
+    chg_push(x, r - VIEW_Y);
+  }
+}
+
+/* record every visible cell of the viewport (full repaint) */
+static void view_mark_all(void) {
+  chg_clear();
+  for (int x = 0; x < VIEW_COLS; x++) {
+    int c = VIEW_X + x;
+    const struct span *sp = &col_spans[(size_t)c * (size_t)SPAN_CAP];
+    for (int k = 0; k < matrix[c].nspans; k++) {
+      int r0 = sp[k].lo > VIEW_Y ? sp[k].lo : VIEW_Y;
+      int r1 = sp[k].hi + 1 < VIEW_Y + VIEW_ROWS ? sp[k].hi + 1 : VIEW_Y + VIEW_ROWS;
+      for (int r = r0; r < r1; r++) chg_push(x, r - VIEW_Y);
+    }
+  }
+}
+
+/* style of canvas cell (c, r) as drawn: a walk over the column's spans */
+static int span_style(int c, int r) {
+  const struct span *sp = &col_spans[(size_t)c * (size_t)SPAN_CAP];
+  for (int k = 0; k < matrix[c].nspans; k++) {
+    if (r < sp[k].lo) return 0;
+    if (r <= sp[k].hi) return sp[k].style;
+  }
+  return 0;
+}
+
+/* order the changed cells by row, then column: LSD radix sort on
+   y * VIEW_COLS + x, a byte per pass, so the cost follows the number of
+   changes and not the viewport width */
+static void sort_changes(void) {
+  uint64_t top = (uint64_t)VIEW_COLS * (uint64_t)VIEW_ROWS;
+  struct cell_ref *src = chg, *dst = chg_tmp;
+  for (int shift = 0; shift < 64 && (top >> shift) > 1; shift += 8) {
+    int cnt[257] = { 0 };
+    for (int k = 0; k < chg_count; k++) {
+      uint64_t key = (uint64_t)src[k].y * (uint64_t)VIEW_COLS + (uint64_t)src[k].x;
+      cnt[((key >> shift) & 255) + 1]++;
+    }
+    for (int b = 0; b < 256; b++) cnt[b + 1] += cnt[b];
+    for (int k = 0; k < chg_count; k++) {
+      uint64_t key = (uint64_t)src[k].y * (uint64_t)VIEW_COLS + (uint64_t)src[k].x;
+      dst[cnt[(key >> shift) & 255]++] = src[k];
+    }
+    struct cell_ref *t = src; src = dst; dst = t;
+  }
+  if (src != chg) memcpy(chg, src, (size_t)chg_count * sizeof(*chg));
+}
+
+/* runs of viewport row y from the sorted changes starting at *k; one
+   variant per style source (STYLE sees c, r and the change ch) */
+#define GATHER_CHANGES_FN(name, STYLE)                                      \
+static int gather_changes_##name(int *k, int y, struct run *runs) {        \
+  int n = 0, r = VIEW_Y + y;                                                \
+  (void)r;                                                                  \
+  for (; *k < chg_count && chg[*k].y == y; (*k)++) {                        \
+    const struct cell_ref *ch = &chg[*k];                                   \
+    int c = VIEW_X + ch->x;                                                 \
+    int style = STYLE;                                                      \
+    if (n > 0 && runs[n - 1].end == c && runs[n - 1].style == style) {      \
+      runs[n - 1].end++;                                                    \
+    } else {                                                                \
+      runs[n].start = c; runs[n].end = c + 1; runs[n].style = style;        \
+      n++;                                                                  \
+    }                                                                       \
+  }                                                                         \
+  return n;                                                                 \
+}
+GATHER_CHANGES_FN(spans, span_style(c, r))
+GATHER_CHANGES_FN(fall, STYLE_MAP[Q.depth][fall_cell(ch->x, y)->style])
+#undef GATHER_CHANGES_FN
+
+/* rewrite rows whose style differs between the old and new span lists;
+   cost is O(spans + changed rows) */
+static void raster_diff(int c, const struct span *old, int no, const struct span *nw, int nn) {
+  int i = 0, j = 0, r = 0;
+  while (i < no || j < nn) {
+    while (i < no && old[i].hi < r) i++;
+    while (j < nn && nw[j].hi < r) j++;
+    int so = (i < no && old[i].lo <= r) ? old[i].style : 0;
+    int sn = (j < nn && nw[j].lo <= r) ? nw[j].style : 0;
+    int next = ROWS;
+    if (i < no) { int b = old[i].lo > r ? old[i].lo : old[i].hi + 1; if (b < next) next = b; }
+    if (j < nn) { int b = nw[j].lo > r ? nw[j].lo : nw[j].hi + 1; if (b < next) next = b; }
+    if (so != sn) {
+      if (OPT.spans) view_mark(c, r, next, so);
+      else for (int rr = r; rr < next; rr++) canvas_set_style(c, rr, (uint8_t)sn);
+    }
+    r = next;
+  }
+}
+
+/* next frame at which column c changes visibly: a head reaching a row,
+   the newest drop clearing the spacing, an idle column waking, or the next
+   flicker */
+static uint64_t column_next_event(int c) {
+  const struct column *col = &matrix[c];
+  uint64_t due = UINT64_MAX;
+  if (col->count == 0 && column_active(c)) due = col->wake > FRAME ? col->wake : FRAME + 1;
+  for (int i = col->drops; i >= 0; i = pool[i].next) {
+    uint64_t t = drop_next_change(&pool[i], FRAME);
+    if (t < due) due = t;
+  }
+  if (col->count > 0 && col->count < OPT.density) {
+    const struct blue_pill *d = &pool[col->drops];
+    uint64_t t = d->cycle >= col->spacing ? FRAME + 1 : drop_frame_at(d, FRAME, col->spacing);
+    if (t < due) due = t;
+  }
+  if (col->flick_at < (double)due) {
+    double t = ceil(col->flick_at);
+    due = t <= (double)FRAME ? FRAME + 1 : (uint64_t)t;
+  }
+  return due;
+}
+
+/* bring the canvas up to date for the columns due this frame: each column's
+   drops are reduced to style spans and diffed against the spans drawn
+   before, so only rows whose style changed are touched; the column is then
+   rescheduled for its next visible change */
+static void build_cur_grid(void) {
+  for (int k = 0; k < due_count; k++) {
+    int c = due_cols[k];
+    struct column *col = &matrix[c];
+    struct span *old = &col_spans[(size_t)c * (size_t)SPAN_CAP];
+    int nn = column_spans(col, span_new);
+    raster_diff(c, old, col->nspans, span_new, nn);
+    memcpy(old, span_new, (size_t)nn * sizeof(struct span));
+    col->nspans = nn;
+    col->visible = 0;
+    for (int j = 0; j < nn; j++) col->visible += span_new[j].hi - span_new[j].lo + 1;
+
+    /* flicker is a Poisson process over the visible cells; it is memoryless,
+       so resampling whenever the visible set changes is exact */
+    col->flick_at = (double)FRAME + rand_exp(Q.flicker * (double)col->visible);
+    col->due = column_next_event(c);
+    sched_push(c);
+  }
+  due_count = 0;
+}
+
+/* ---- falling glyphs ---- */
+/* rows of blank before a column's next stream */
+static int fall_gap(void) {
+  int gap = rand() % (VIEW_ROWS / OPT.density + 1);
+  if (IDLE_MEAN > 0.0) gap += (int)rand_exp(1.0 / (IDLE_MEAN * 0.3 * (double)OPT.speed));
+  return gap;
+}
+
+/* style of the cell i rows behind the head of a stream of len cells; it
+   moves with the glyph, so a drawn cell never needs restyling */
+static inline uint8_t fall_style(int i, int len, int bold) {
+  int t = len - 1 - i; /* rows to the end of the trail */
+  if (i == 0) return 5;
+  if (i == 1) return 4;
+  if (OPT.gradient) return (uint8_t)(STYLE_GRAD + t * OPT.gradient / (len - 2));
+  if (t >= 3) return bold ? 3 : 2;
+  return t >= 1 ? 2 : 1;
+}
+
+/* move the screen down one row and bring in the next one at the top */
+static void fall_scroll(void) {
+  int rows = VIEW_ROWS, cols = VIEW_COLS, lit = 0;
+  for (int x = 0; x < cols; x++) {
+    struct fall_col *s = &fall_cols[x];
+    Cell *cell = &fall_row[x];
+    if (s->left == 0 && s->gap == 0 && column_active(VIEW_X + x)) {
+      struct blue_pill d;
+      pick_lifespan_for_column(&d, rows, mix64((uint64_t)(uint32_t)rand()));
+      s->len = s->left = d.lifespan;
+      s->bold = rand() % 100 > 60;
+    }
+    if (s->left > 0) {
+      s->left--;
+      cell->style = fall_style(s->len - s->left - 1, s->len, s->bold);
+      cell->glyph = rand_glyph();
+      if (s->left == 0) s->gap = fall_gap();
+      lit++;
+    } else {
+      cell->style = 0;
+      if (s->gap > 0) s->gap--;
+    }
+  }
+
+  if (OPT.fall == FALL_REWRITE) {
+    /* every cell whose content differs from the one above it moves */
+    for (int y = 0; y < rows; y++) {
+      const Cell *above = y ? fall_cell(0, y - 1) : fall_row, *cur = fall_cell(0, y);
+      for (int x = 0; x < cols; x++)
+        if (above[x].style != cur[x].style || (cur[x].style && above[x].glyph != cur[x].glyph))
+          chg_push(x, y);
+    }
+  } else {
+    /* the terminal moves everything; pending patches move with it */
+    int n = chg_count;
+    chg_clear();
+    for (int k = 0; k < n; k++)
+      if (chg[k].y + 1 < rows) chg_push(chg[k].x, chg[k].y + 1);
+    for (int x = 0; x < cols; x++)
+      if (fall_row[x].style) chg_push(x, 0);
+    if (fall_live > 0 && fall_pending < rows) fall_pending++; /* a blank screen needs no SD */
+  }
+
+  const Cell *bottom = fall_cell(0, rows - 1);
+  for (int x = 0; x < cols; x++) fall_live -= bottom[x].style != 0;
+  fall_top = fall_top ? fall_top - 1 : rows - 1;
+  memcpy(fall_cell(0, 0), fall_row, (size_t)cols * sizeof(Cell));
+  fall_live += lit;
+}
+
+/* bring the streams up to FRAME: scroll at the mean drop speed, then
+   flicker about Q.flicker of the lit cells per frame */
+static void fall_step(void) {
+  double frames = (double)(FRAME - fall_frame);
+  fall_frame = FRAME;
+  if (VIEW_COLS <= 0 || VIEW_ROWS <= 0) return;
+  fall_acc += frames * 0.3 * (double)OPT.speed;
+  while (fall_acc >= 1.0) {
+    fall_acc -= 1.0;
+    fall_scroll();
+  }
+  fall_flick += Q.flicker * (double)fall_live * frames;
+  for (; fall_flick >= 1.0; fall_flick -= 1.0) {
+    for (int tries = 0; tries < 16; tries++) {
+      int x = rand() % VIEW_COLS, y = rand() % VIEW_ROWS;
+      Cell *cell = fall_cell(x, y);
+      if (!cell->style) continue;
+      cell->glyph = rand_glyph();
+      chg_push(x, y);
+      break;
+    }
+  }
+}
+
+/* next frame with a visible change: every frame while flicker is on, at
+   once while changes of a dropped frame are still to be sent, and on a
+   blank screen not before the first lit row comes in */
+static uint64_t fall_due(void) {
+  if (chg_count > 0 || fall_pending > 0) return fall_frame;
+  if (Q.flicker > 0.0 && fall_live > 0) return fall_frame + 1;
+  double rate = 0.3 * (double)OPT.speed, scrolls = 1.0;
+  if (fall_live == 0) {
+    int gap = INT_MAX;
+    for (int x = 0; x < VIEW_COLS; x++)
+      if (fall_cols[x].gap < gap) gap = fall_cols[x].gap;
+    if (gap < INT_MAX) scrolls += gap;
+  }
+  return fall_frame + (uint64_t)ceil((scrolls - fall_acc) / rate);
+}
+
+/* every lit cell of the viewport (full repaint) */
+static void fall_mark_all(void) {
+  chg_clear();
+  for (int y = 0; y < VIEW_ROWS; y++) {
+    const Cell *row = fall_cell(0, y);
+    for (int x = 0; x < VIEW_COLS; x++)
+      if (row[x].style) chg_push(x, y);
+  }
+}
+
+/* encoder state while building one frame */
+struct enc {
+  void (*glyphs)(struct enc *e, int r, int c0, int c1); /* emit_glyphs_* variant */
+  char *p;
+  int   row, col; /* viewport cell the cursor is on, -1 = unknown */
+  int   sgr;      /* style of the last SGR emitted, -1 = unknown */
+  uint64_t moves; /* cursor moves emitted */
+  /* iovec output only (iov == NULL when copying) */
+  struct iovec *iov;
+  int   niov;
+  int   floor;    /* iovecs below this index are not extended */
+  char *mark;     /* start of the bytes at p not yet in an iovec */
+  size_t bytes;   /* bytes in iov[0, niov) */
+};
+
+static inline void iov_add(struct enc *e, const char *s, size_t n) {
+  struct iovec *last = &e->iov[e->niov - 1];
+  if (e->niov > e->floor && (const char *)last->iov_base + last->iov_len == s) {
+    last->iov_len += n;
+  } else {
+    e->iov[e->niov].iov_base = (void *)(uintptr_t)s;
+    e->iov[e->niov].iov_len = n;
+    e->niov++;
+  }
+  e->bytes += n;
+}
+
+/* close the run of bytes written at p since the last fragment */
+static inline void enc_cut(struct enc *e) {
+  if (e->iov && e->p > e->mark) {
+    iov_add(e, e->mark, (size_t)(e->p - e->mark));
+    e->mark = e->p;
+  }
+}
+
+/* a fixed fragment: referenced in place with iovec output, copied otherwise */
+static inline void enc_ref(struct enc *e, const char *s, size_t n) {
+  if (!e->iov) {
+    memcpy(e->p, s, n);
+    e->p += n;
+    return;
+  }
+  enc_cut(e);
+  iov_add(e, s, n);
+}
+
+static const Cell BLANK_CELL = { 0, 0 };
+
+/* current cell at canvas (c, r), blank where no tile is allocated */
+static inline const Cell *cur_cell(int c, int r) {
+  const Tile *t = tiles[tile_index(c, r)];
+  return t ? &t->cur[tile_slot(c, r)] : &BLANK_CELL;
+}
+
+static inline int cell_style(int c, int r) {
+  if (OPT.fall) return STYLE_MAP[Q.depth][fall_cell(c - VIEW_X, r - VIEW_Y)->style];
+  return OPT.spans ? span_style(c, r) : cur_cell(c, r)->style;
+}
+
+static inline uint16_t cell_glyph(int c, int r) {
+  if (OPT.fall) return fall_cell(c - VIEW_X, r - VIEW_Y)->glyph;
+  if (OPT.spans) {
+    size_t i = (size_t)(r - VIEW_Y) * (size_t)VIEW_COLS + (size_t)(c - VIEW_X);
+    return OPT.counter_glyphs ? hash_glyph(c, r, view_epoch[i]) : view_glyphs[i];
+  }
+  return cur_cell(c, r)->glyph;
+}
+
+static inline int dec_digits(int v) {
+  int n = 1;
+  while (v >= 10) { v /= 10; n++; }
+  return n;
+}
+
+/* physical columns covered by viewport cells [x0, x1): the trailing space of
+   the last cell is dropped when it does not fit */
+static inline int phys_span(int x0, int x1) {
+  int n = 2 * (x1 - x0);
+  if (2 * x1 > PHYS_COLS) n -= 2 * x1 - PHYS_COLS;
+  return n;
+}
+
+static void emit_move(struct enc *e, int y, int x) {
+  if (e->row == y && e->col == x) return;
+  if (e->row == y && e->col >= 0) {
+    /* same row: a relative CUF/CUB is shorter than an absolute CUP */
+    int d = 2 * (x - e->col);
+    int rel = 3 + dec_digits(d < 0 ? -d : d);
+    int abs_len = 4 + dec_digits(y + 1) + dec_digits(2 * x + 1);
+    if (rel < abs_len) {
+      char tmp[16];
+      int n = d > 0 ? snprintf(tmp, sizeof(tmp), "\x1b[%dC", d)
+                    : snprintf(tmp, sizeof(tmp), "\x1b[%dD", -d);
+      memcpy(e->p, tmp, (size_t)n);
+      e->p += n;
+      e->col = x;
+      e->moves++;
+      return;
+    }
+  }
+  /* move cursor to physical column for logical x (1-based): 2*x + 1 */
+  buf_move_cursor(&e->p, y + 1, 2 * x + 1);
+  e->row = y; e->col = x;
+  e->moves++;
+}
+
+static void emit_sgr(struct enc *e, int style) {
+  const char *seq = (Q.depth > 0 ? SGR_16 : SGR_MAP)[style];
+  if (style == 0 || style == e->sgr || !seq) return;
+  enc_ref(e, seq, strlen(seq));
+  e->sgr = style;
+}
+
+/* glyphs of canvas row r, columns [c0, c1), each followed by the gap space.
+   Generated per glyph source and output mode, so the loops hold no test
+   that is fixed for the frame. Only a last cell at an odd right edge goes
+   without its space: that one gets a loop of its own. */
+#define GLYPH_SOURCES(X)                                          \
+  X(grid,    cur_cell(VIEW_X + x, r)->glyph)                      \
+  X(counter, hash_glyph(VIEW_X + x, r, view_epoch[vrow + (size_t)x])) \
+  X(stored,  view_glyphs[vrow + (size_t)x])                       \
+  X(fall,    fall_cell(x, r - VIEW_Y)->glyph)
+
+/* copy: the pair is copied 8 bytes at a time, the pointer advances by n */
+#define PUT_COPY(g, n) do { memcpy(e->p, GLYPH_PAIRS[g], 8); e->p += (n); } while (0)
+#define PUT_IOV(g, n)  do { enc_cut(e); iov_add(e, GLYPH_PAIRS[g], (size_t)(n)); } while (0)
+
+#define EMIT_GLYPHS_FN(name, GLYPH, PUT)                                    \
+static void emit_glyphs_##name(struct enc *e, int r, int c0, int c1) {     \
+  size_t vrow = (size_t)(r - VIEW_Y) * (size_t)VIEW_COLS;                   \
+  int x = c0 - VIEW_X, x1 = c1 - VIEW_X;                                    \
+  int xs = x1 < PHYS_COLS / 2 ? x1 : PHYS_COLS / 2; /* spaced cells end */  \
+  (void)vrow;                                                               \
+  for (; x < xs; x++) { uint16_t g = GLYPH; PUT(g, GLYPHS[g].len + 1); }    \
+  for (; x < x1; x++) { uint16_t g = GLYPH; PUT(g, GLYPHS[g].len); }        \
+  e->col = x1;                                                              \
+  if (2 * e->col >= PHYS_COLS) e->col = -1; /* pending wrap at the edge */  \
+}
+#define EMIT_GLYPHS_VARIANTS(name, GLYPH)          \
+  EMIT_GLYPHS_FN(name##_copy, GLYPH, PUT_COPY)     \
+  EMIT_GLYPHS_FN(name##_iov, GLYPH, PUT_IOV)
+GLYPH_SOURCES(EMIT_GLYPHS_VARIANTS)
+
+#define GLYPH_SOURCE_ENUM(name, GLYPH) GLYPHS_FROM_##name,
+#define EMIT_GLYPHS_ENTRY(name, GLYPH) { emit_glyphs_##name##_copy, emit_glyphs_##name##_iov },
+enum { GLYPH_SOURCES(GLYPH_SOURCE_ENUM) };
+static void (*const EMIT_GLYPHS[][2])(struct enc *, int, int, int) = {
+  GLYPH_SOURCES(EMIT_GLYPHS_ENTRY)
+};
+#undef GLYPH_SOURCE_ENUM
+#undef EMIT_GLYPHS_ENTRY
+#undef EMIT_GLYPHS_VARIANTS
+#undef EMIT_GLYPHS_FN
+#undef PUT_IOV
+#undef PUT_COPY
+
+/* blank viewport cells [x0, x1) of the cursor row: EL when the blank reaches
+   the viewport edge, ECH when shorter than spaces (plus CUF when the cursor
+   has to end up past the blank), spaces otherwise */
+static void emit_blank(struct enc *e, int x0, int x1, int advance) {
+  int n = phys_span(x0, x1);
+  if (x1 == VIEW_COLS) {
+    enc_ref(e, "\x1b[K", 3);
+    return; /* cursor stays at x0 */
+  }
+  int ech = 3 + dec_digits(n) + (advance ? 3 + dec_digits(n) : 0);
+  if (ech < n) {
+    char tmp[32];
+    int k = advance ? snprintf(tmp, sizeof(tmp), "\x1b[%dX\x1b[%dC", n, n)
+                    : snprintf(tmp, sizeof(tmp), "\x1b[%dX", n);
+    memcpy(e->p, tmp, (size_t)k);
+    e->p += k;
+    if (advance) e->col = x1;
+    return;
+  }
+  memset(e->p, ' ', (size_t)n);
+  e->p += n;
+  e->col = x1;
+}
+
+/* runs of canvas row r that need updating, merged across tile boundaries:
+   every non-blank cell for a repaint (full), changed cells otherwise (diff) */
+#define GATHER_RUNS_FN(name, NEED)                                          \
+static int gather_runs_##name(int r, struct run *runs) {                   \
+  int n = 0;                                                                \
+  int tx0 = VIEW_X >> TILE_SHIFT_X, tx1 = (VIEW_X + VIEW_COLS - 1) >> TILE_SHIFT_X; \
+  size_t row_base = (size_t)(r >> TILE_SHIFT_Y) * (size_t)TILES_X;          \
+  unsigned rbit = 1u << (r & (TILE_H - 1));                                 \
+  for (int tx = tx0; tx <= tx1; tx++) {                                     \
+    size_t ti = row_base + (size_t)tx;                                      \
+    if (!((dirty_l1[ti >> 6] >> (ti & 63)) & 1u)) continue;                 \
+    const Tile *t = tiles[ti];                                              \
+    if (!t || !(t->dirty_rows & rbit)) continue;                            \
+    int c0 = tx << TILE_SHIFT_X, c1 = c0 + TILE_W;                          \
+    if (c0 < VIEW_X) c0 = VIEW_X;                                           \
+    if (c1 > VIEW_X + VIEW_COLS) c1 = VIEW_X + VIEW_COLS;                   \
+                                                                            \
+    const Cell *cur = &t->cur[tile_slot(0, r)];                             \
+    const Cell *prv = &t->prev[tile_slot(0, r)];                            \
+    (void)prv;                                                              \
+    for (int c = c0; c < c1; c++) {                                         \
+      int i = c & (TILE_W - 1);                                             \
+      if (!(NEED)) continue;                                                \
+      if (n > 0 && runs[n - 1].end == c && runs[n - 1].style == cur[i].style) { \
+        runs[n - 1].end++;                                                  \
+      } else {                                                              \
+        runs[n].start = c; runs[n].end = c + 1; runs[n].style = cur[i].style; \
+        n++;                                                                \
+      }                                                                     \
+    }                                                                       \
+  }                                                                         \
+  return n;                                                                 \
+}
+GATHER_RUNS_FN(full, cur[i].style != 0)
+GATHER_RUNS_FN(diff, cur[i].style != prv[i].style ||
+                     (cur[i].style != 0 && cur[i].glyph != prv[i].glyph))
+#undef GATHER_RUNS_FN
+
+/* diff strategy: one cursor move (when needed) and SGR per changed run */
+static void encode_row_diff(struct enc *e, int r, const struct run *runs, int n) {
+  int y = r - VIEW_Y;
+  for (int k = 0; k < n; k++) {
+    emit_move(e, y, runs[k].start - VIEW_X);
+    if (runs[k].style == 0) {
+      emit_blank(e, runs[k].start - VIEW_X, runs[k].end - VIEW_X, 0);
+    } else {
+      emit_sgr(e, runs[k].style);
+      e->glyphs(e, r, runs[k].start, runs[k].end);
+    }
+  }
+}
+
+/* rewrite strategy: one cursor move, then every cell from the first to the
+   last changed column, unchanged ones included */
+static void encode_row_rewrite(struct enc *e, int r, int lo, int hi) {
+  int y = r - VIEW_Y;
+  emit_move(e, y, lo - VIEW_X);
+  int c = lo;
+  while (c < hi) {
+    int style = cell_style(c, r);
+    int end = c + 1;
+    while (end < hi && cell_style(end, r) == style) end++;
+    if (style == 0) {
+      emit_blank(e, c - VIEW_X, end - VIEW_X, end < hi);
+    } else {
+      emit_sgr(e, style);
+      e->glyphs(e, r, c, end);
+    }
+    c = end;
+  }
+}
+
+/* diff renderer: encodes the changed cells of the viewport into outbuf, row
+   by row over the dirty tiles (or the sorted changed cells with --render
+   spans), and returns the bytes to flush. Rows with several runs are also
+   encoded as a single rewrite and whichever is shorter is kept. */
+static size_t render_diff(int force_full) {
+  struct enc e = { NULL, outbuf, -1, -1, -1, 0, NULL, 0, 0, outbuf, 0 };
+  uint64_t cells = 0;
+  if (use_iov) e.iov = out_iov;
+  if (OPT.output == OUT_AUTO) OUTSEL.t0 = ns_now();
+
+  int sorted = OPT.spans || OPT.fall; /* changes come from the chg list */
+  /* --sync: begin a synchronized update; taken back if the frame is empty */
+  struct enc unsynced = e;
+  if (OPT.sync) enc_ref(&e, "\x1b[?2026h", 8);
+  struct enc synced = e;
   if (force_full) {
-    /* clear and home once */
-    buf_puts(&ptr, "\x1b[2J\x1b[H");
-  }
-
-  for (int r = 0; r < ROWS; r++) {
-    int c = 0;
-    while (c < COLS) {
-      Cell *cur = &cur_grid[(size_t)r * (size_t)COLS + (size_t)c];
-      Cell *prv = &prev_grid[(size_t)r * (size_t)COLS + (size_t)c];
-
-      int unchanged = (!force_full) &&
-                      (cur->style == prv->style) &&
-                      (cur->style == 0 || cur->ch == prv->ch);
-      if (unchanged) { c++; continue; }
-
-      /* start a run at c with this style; extend while cells need update and share style */
-      uint8_t style = cur->style;
-      int start = c, end = c + 1;
-      while (end < COLS) {
-        Cell *cc = &cur_grid[(size_t)r * (size_t)COLS + (size_t)end];
-        Cell *pp = &prev_grid[(size_t)r * (size_t)COLS + (size_t)end];
-
-        int need = force_full ||
-                   (cc->style != pp->style) ||
-                   (cc->style != 0 && cc->ch != pp->ch);
-        if (!need || cc->style != style) break;
-        end++;
+    /* clear and home once, then draw everything non-blank */
+    if (OPT.fall) {
+      /* scroll only the viewport rows */
+      char tmp[32];
+      int n = snprintf(tmp, sizeof(tmp), "\x1b[1;%dr", VIEW_ROWS);
+      memcpy(e.p, tmp, (size_t)n);
+      e.p += n;
+    }
+    enc_ref(&e, "\x1b[2J\x1b[H", 7);
+    e.row = 0; e.col = 0;
+    if (OPT.fall) fall_mark_all();
+    else if (OPT.spans) view_mark_all();
+    else canvas_mark_viewport();
+  } else if (OPT.fall && fall_pending > 0) {
+    /* SD: the terminal moves the rows, only the new ones are drawn */
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "\x1b[%dT", fall_pending);
+    memcpy(e.p, tmp, (size_t)n);
+    e.p += n;
+  }
+  fall_pending = 0;
+  int pos = 0; /* next sorted change */
+  if (sorted) sort_changes();
+
+  /* the variants for this frame */
+  int (*gather)(int *, int, struct run *) = OPT.fall ? gather_changes_fall : gather_changes_spans;
+  int (*gather_grid)(int, struct run *) = force_full ? gather_runs_full : gather_runs_diff;
+  int src = OPT.fall ? GLYPHS_FROM_fall
+          : !OPT.spans ? GLYPHS_FROM_grid
+          : OPT.counter_glyphs ? GLYPHS_FROM_counter : GLYPHS_FROM_stored;
+  e.glyphs = EMIT_GLYPHS[src][e.iov != NULL];
+
+  for (int r = VIEW_Y; VIEW_COLS > 0 && r < VIEW_Y + VIEW_ROWS; r++) {
+    if (sorted) {
+      /* straight to the next row with changes */
+      if (pos >= chg_count) break;
+      r = VIEW_Y + chg[pos].y;
+    }
+    int n = sorted ? gather(&pos, r - VIEW_Y, row_runs) : gather_grid(r, row_runs);
+    if (n == 0) continue;
+    int lo = row_runs[0].start, hi = row_runs[n - 1].end;
+    int changed = 0;
+    for (int k = 0; k < n; k++) changed += row_runs[k].end - row_runs[k].start;
+
+    /* a rewrite resends every unchanged cell between runs (2+ bytes each)
+       where diff pays one short move per run, so only rows with small gaps
+       are worth encoding both ways */
+    if (OPT.adaptive && n > 1 && (hi - lo) - changed <= 2 * (n - 1) && e.iov) {
+      /* both encodings go on the list, the rewrite after the diff; the
+         longer one is cut out again (its bytes at p are just left unused) */
+      enc_cut(&e);
+      struct enc d = e;
+      d.floor = e.niov;
+      encode_row_diff(&d, r, row_runs, n);
+      enc_cut(&d);
+      struct enc w = e;
+      w.p = w.mark = d.p;
+      w.niov = w.floor = d.niov;
+      w.bytes = d.bytes;
+      encode_row_rewrite(&w, r, lo, hi);
+      enc_cut(&w);
+      if (w.bytes - d.bytes < d.bytes - e.bytes) {
+        memmove(&out_iov[e.niov], &out_iov[d.niov], (size_t)(w.niov - d.niov) * sizeof(*out_iov));
+        w.niov = e.niov + (w.niov - d.niov);
+        w.bytes = e.bytes + (w.bytes - d.bytes);
+        w.floor = 0;
+        e = w;
+        cells += (uint64_t)(hi - lo);
+        STATS.rewrites++;
+        continue;
       }
+      d.floor = 0;
+      e = d;
+    } else if (OPT.adaptive && n > 1 && (hi - lo) - changed <= 2 * (n - 1)) {
+      struct enc d = e, w = e;
+      encode_row_diff(&d, r, row_runs, n);
+      w.p = row_scratch;
+      encode_row_rewrite(&w, r, lo, hi);
+      size_t wlen = (size_t)(w.p - row_scratch);
+      if (wlen < (size_t)(d.p - e.p)) {
+        memcpy(e.p, row_scratch, wlen);
+        w.p = e.p + wlen;
+        e = w;
+        cells += (uint64_t)(hi - lo);
+        STATS.rewrites++;
+        continue;
+      }
+      e = d;
+    } else {
+      encode_row_diff(&e, r, row_runs, n);
+    }
+    cells += (uint64_t)changed;
+  }
+
+  /* copy current -> previous for dirty tiles only */
+  if (sorted) chg_clear();
+  else canvas_settle();
 
-      /* move cursor to physical column for logical 'start' (1-based): 2*start + 1 */
-      buf_move_cursor(&ptr, r + 1, 2 * start + 1);
+  if (OPT.sync) {
+    if (e.p == synced.p && e.niov == synced.niov) e = unsynced;
+    else enc_ref(&e, "\x1b[?2026l", 8);
+  }
 
-      /* set SGR for non-blank */
-      if (style != 0 && SGR_MAP[style]) buf_puts(&ptr, SGR_MAP[style]);
+  size_t len = (size_t)(e.p - outbuf);
+  frame_niov = 0;
+  if (e.iov) {
+    enc_cut(&e);
+    len = e.bytes;
+    frame_niov = e.niov;
+  }
+  OUTSEL.cls = 0;
+  for (uint64_t run = e.moves ? cells / e.moves : 0; run >= 2 && OUTSEL.cls < RUN_CLASSES - 1; run >>= 1)
+    OUTSEL.cls++;
+  STATS.frames++;
+  if (e.iov) STATS.iov_frames++;
+  STATS.bytes += len;
+  STATS.cells += cells;
+  STATS.runs += e.moves;
+  return len;
+}
 
-      /* emit the run */
-      for (int x = start; x < end; x++) {
-        Cell *cc = &cur_grid[(size_t)r * (size_t)COLS + (size_t)x];
+/* --output auto: charge the frame just built (and written) to its mode and
+   run-length class, then pick the mode for the next one */
+static void output_sample(size_t len) {
+  if (OPT.output != OUT_AUTO || len == 0) return;
+  int c = OUTSEL.cls, m = frame_niov > 0;
+  double ns = (double)(ns_now() - OUTSEL.t0), b = (double)len;
+  /* time and bytes are summed over the first OUT_WARMUP samples, then
+     decayed by 1/OUT_WARMUP a sample, so small frames (fixed costs) weigh
+     little and a lucky try alone cannot flip the class. A sample counts
+     for at most twice the going rate, so a cold first frame (page faults,
+     empty caches) can't either. */
+  double *t = &OUTSEL.ns[m][c], *by = &OUTSEL.bytes[m][c];
+  uint32_t n = ++OUTSEL.n[m][c];
+  if (n > 1 && ns > 2.0 * b * *t / *by) ns = 2.0 * b * *t / *by;
+  if (n > OUT_WARMUP) {
+    *t -= *t / OUT_WARMUP;
+    *by -= *by / OUT_WARMUP;
+  }
+  *t += ns;
+  *by += b;
 
-        if (style == 0) {
-          /* blank: print a single space (consumes one physical cell) */
-          buf_putc(&ptr, ' ');
-        } else {
-          /* printable char */
-          buf_putc(&ptr, cc->ch);
-        }
+  if (OUTSEL.n[0][c] < OUT_WARMUP || OUTSEL.n[1][c] < OUT_WARMUP) {
+    use_iov = OUTSEL.n[1][c] < OUTSEL.n[0][c]; /* take turns until both have a fair figure */
+    return;
+  }
+  double copy = OUTSEL.ns[0][c] / OUTSEL.bytes[0][c], iov = OUTSEL.ns[1][c] / OUTSEL.bytes[1][c];
+  uint8_t *pick = &OUTSEL.pick[c];
+  if (*pick ? copy < iov * OUT_MARGIN : iov < copy * OUT_MARGIN) *pick = !*pick;
+  use_iov = *pick != (++OUTSEL.frames[c] % OUT_RECHECK == 0);
+}
+
+static void flush_frame(size_t len) {
+  if (!len) return;
+  if (frame_niov == 0) {
+    (void)write(1, outbuf, len);
+  } else {
+    for (int k = 0; k < frame_niov; k += IOV_MAX)
+      (void)writev(1, &out_iov[k], frame_niov - k < IOV_MAX ? frame_niov - k : IOV_MAX);
+  }
+  PROBE2(write__done, len, frame_niov);
+  output_sample(len);
+}
+
+/* ---- shared memory export: publishing ---- */
+/* map a segment big enough for the current viewport; 0 when unchanged */
+static int shm_layout(void) {
+  size_t cells = (size_t)VIEW_COLS * (size_t)VIEW_ROWS;
+  size_t glyphs_off = sizeof(struct shm_header) + cells * sizeof(struct shm_cell);
+  size_t bytes = glyphs_off + (size_t)GLYPH_COUNT * sizeof(struct shm_glyph);
+  if (SHM && SHM->cols == (uint32_t)VIEW_COLS && SHM->rows == (uint32_t)VIEW_ROWS) return 0;
+  if (bytes > UINT32_MAX) return -1;
+  if (bytes > shm_mapped) {
+    if (ftruncate(shm_fd, (off_t)bytes) != 0) return -1;
+    void *m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (m == MAP_FAILED) return -1;
+    if (SHM) munmap(SHM, shm_mapped);
+    SHM = (struct shm_header *)m;
+    shm_mapped = bytes;
+  }
+  uint64_t seq = atomic_load_explicit(&SHM->seq, memory_order_relaxed);
+  atomic_store_explicit(&SHM->seq, seq | 1u, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  SHM->magic = SHM_MAGIC;
+  SHM->version = SHM_VERSION;
+  SHM->cols = (uint32_t)VIEW_COLS;
+  SHM->rows = (uint32_t)VIEW_ROWS;
+  SHM->cells_offset = (uint32_t)sizeof(struct shm_header);
+  SHM->glyphs_offset = (uint32_t)glyphs_off;
+  SHM->glyph_count = (uint32_t)GLYPH_COUNT;
+  SHM->bytes = (uint32_t)bytes;
+  struct shm_glyph *g = (struct shm_glyph *)((char *)SHM + glyphs_off);
+  for (int i = 0; i < GLYPH_COUNT; i++) {
+    memcpy(g[i].utf8, GLYPHS[i].utf8, 4);
+    g[i].len = GLYPHS[i].len;
+    memset(g[i].pad, 0, sizeof(g[i].pad));
+  }
+  atomic_store_explicit(&SHM->seq, (seq | 1u) + 1u, memory_order_release);
+  return 1;
+}
+
+static inline void shm_put(struct shm_cell *cells, int x, int y) {
+  int c = VIEW_X + x, r = VIEW_Y + y;
+  struct shm_cell *cell = &cells[(size_t)y * (size_t)VIEW_COLS + (size_t)x];
+  cell->style = (uint8_t)cell_style(c, r);
+  cell->glyph = cell->style ? cell_glyph(c, r) : 0;
+}
 
-        /* add trailing space if it fits in the physical width */
-        int phys_next_col = 2 * x + 2; /* position of the trailing space */
-        if (phys_next_col <= PHYS_COLS) buf_putc(&ptr, ' ');
+/* publish the cells changed since the last frame (all of them after a
+   repaint or a resize); call after the build and before render_diff */
+static void shm_publish(int full) {
+  int r = shm_layout();
+  if (r < 0) return;
+  if (r > 0) full = 1;
+  struct shm_cell *cells = (struct shm_cell *)((char *)SHM + SHM->cells_offset);
+
+  uint64_t seq = atomic_load_explicit(&SHM->seq, memory_order_relaxed);
+  atomic_store_explicit(&SHM->seq, seq + 1u, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  SHM->frame = FRAME;
+  if (full || OPT.fall) {
+    for (int y = 0; y < VIEW_ROWS; y++)
+      for (int x = 0; x < VIEW_COLS; x++) shm_put(cells, x, y);
+  } else if (OPT.spans) {
+    for (int k = 0; k < chg_count; k++) shm_put(cells, chg[k].x, chg[k].y);
+  } else {
+    /* dirty rows of the tiles under the viewport */
+    int tx0 = VIEW_X >> TILE_SHIFT_X, tx1 = (VIEW_X + VIEW_COLS - 1) >> TILE_SHIFT_X;
+    for (int y = 0; y < VIEW_ROWS; y++) {
+      int row = VIEW_Y + y;
+      unsigned rbit = 1u << (row & (TILE_H - 1));
+      for (int tx = tx0; tx <= tx1; tx++) {
+        const Tile *t = tiles[tile_index(tx << TILE_SHIFT_X, row)];
+        if (!t || !(t->dirty_rows & rbit)) continue;
+        int c0 = tx << TILE_SHIFT_X, c1 = c0 + TILE_W;
+        if (c0 < VIEW_X) c0 = VIEW_X;
+        if (c1 > VIEW_X + VIEW_COLS) c1 = VIEW_X + VIEW_COLS;
+        for (int c = c0; c < c1; c++) shm_put(cells, c - VIEW_X, y);
       }
+    }
+  }
+  atomic_store_explicit(&SHM->seq, seq + 2u, memory_order_release);
+}
 
-      c = end;
+/* flicker one random visible cell of column c */
+static void flicker_column(int c, const struct column *col) {
+  const struct span *sp = &col_spans[(size_t)c * (size_t)SPAN_CAP];
+  int u = rand() % col->visible;
+  for (int k = 0; k < col->nspans; k++) {
+    int len = sp[k].hi - sp[k].lo + 1;
+    if (u < len) {
+      if (OPT.spans) view_mark(c, sp[k].lo + u, sp[k].lo + u + 1, 0);
+      else canvas_flicker(c, sp[k].lo + u);
+      return;
     }
+    u -= len;
   }
+}
 
-  /* flush */
-  size_t len = (size_t)(ptr - outbuf);
-  if (len) (void)write(1, outbuf, len);
+/* bring the drops of column c to frame f: advance them, retire finished
+   ones and start a new one when the spawn rule allows */
+static void column_step(int c, uint64_t f) {
+  struct column *col = &matrix[c];
+  int had = col->count;
 
-  /* swap/copy current -> previous */
-  memcpy(prev_grid, cur_grid, (size_t)COLS * (size_t)ROWS * sizeof(Cell));
+  /* advance; finished drops go back to the pool */
+  int *link = &col->drops;
+  while (*link >= 0) {
+    struct blue_pill *d = &pool[*link];
+    d->cycle = drop_cycle(d, f);
+    if (d->cycle > (float)(ROWS + d->lifespan)) {
+      int i = *link;
+      *link = d->next;
+      release_drop(i);
+      col->count--;
+    } else {
+      link = &d->next;
+    }
+  }
+
+  /* a column that just emptied idles for a while (none without
+     --sparsity); others wait for the newest drop to clear the spacing */
+  if (had > 0 && col->count == 0) col->wake = f + idle_delay(c, col);
+  if (!column_active(c)) return;
+  if (col->count == 0 ? f >= col->wake
+                      : (col->count < OPT.density && pool[col->drops].cycle >= col->spacing))
+    spawn_drop(c, ROWS, f);
 }
 
-/* simulate rain */
+/* simulate rain: bring the columns due at FRAME up to that frame; columns
+   with nothing visible to change are not touched at all */
 static void simulate_matrix(void) {
+  while (sched_len > 0 && sched_due() <= FRAME) {
+    int c = sched_pop();
+    struct column *col = &matrix[c];
+    due_cols[due_count++] = c;
+
+    /* flicker: only glyphs on the canvas can be seen changing */
+    while (col->flick_at <= (double)FRAME) {
+      flicker_column(c, col);
+      col->flick_at += rand_exp(Q.flicker * (double)col->visible);
+    }
+
+    column_step(c, FRAME);
+  }
+}
+
+/* ---- seek ---- */
+/* next frame after f at which column_step changes the column's drop list:
+   a drop passing the bottom or the newest one clearing the spacing */
+static uint64_t column_next_spawn(const struct column *col, uint64_t f) {
+  if (col->count == 0) return col->wake > f ? col->wake : f + 1;
+  uint64_t t = UINT64_MAX;
+  for (int i = col->drops; i >= 0; i = pool[i].next) {
+    const struct blue_pill *d = &pool[i];
+    float end = (float)(ROWS + d->lifespan);
+    uint64_t g = drop_frame_at(d, f, end);
+    if (drop_cycle(d, g) <= end) g++;
+    if (g < t) t = g;
+  }
+  if (col->count > 0 && col->count < OPT.density) {
+    uint64_t g = drop_frame_at(&pool[col->drops], f, col->spacing);
+    if (g < t) t = g;
+  }
+  return t;
+}
+
+/* jump the simulation from FRAME to frame 'target'. Drop parameters are
+   counter-based and the spawn rule only looks at the column's own drops,
+   so each column steps from one spawn or retirement to the next rather
+   than through every frame. The result is the frame-by-frame state; only
+   flicker history is not replayed (glyphs start fresh). The next frame
+   needs a full repaint. */
+static void seek_frame(uint64_t target) {
+  if (target <= FRAME) return;
+  if (OPT.fall) {
+    /* streams are not keyed by frame; only the last screenful of scrolls
+       can still be seen, so run just those (the next frame is a repaint) */
+    uint64_t fill = (uint64_t)((double)(VIEW_ROWS + 1) / (0.3 * (double)OPT.speed)) + 1;
+    if (target - fall_frame > fill) fall_frame = target - fill;
+    FRAME = target;
+    fall_step();
+    return;
+  }
   for (int c = 0; c < COLS; c++) {
-    for (int r = 0; r < ROWS; r++) {
-      if ((rand() % 100) > 98) {
-        matrix[c].rsi[r] = CHARS[rand() % chars_len()];
-      }
+    struct column *col = &matrix[c];
+    for (uint64_t f = FRAME; ; ) {
+      f = column_next_spawn(col, f);
+      if (f > target) break;
+      column_step(c, f);
     }
-    matrix[c].cycle += matrix[c].speed;
-    if (matrix[c].cycle > ROWS + matrix[c].lifespan) {
-      free(matrix[c].rsi);
-      matrix[c].rsi = (char *)malloc((size_t)ROWS);
-      if (!matrix[c].rsi) continue;
-      matrix[c].speed = ((((float)rand() / (float)RAND_MAX) + 0.1f) / 2.0f);
-      matrix[c].cycle = 0.0f;
-      pick_lifespan_for_column(&matrix[c], ROWS);
-      for (int r = 0; r < ROWS; r++) matrix[c].rsi[r] = CHARS[rand() % chars_len()];
-      matrix[c].bold = (rand() % 100 > 60);
+    for (int i = col->drops; i >= 0; i = pool[i].next) pool[i].cycle = drop_cycle(&pool[i], target);
+    col->flick_at = HUGE_VAL; /* resampled once the column is rasterized */
+  }
+  sched_reset(target);
+  FRAME = target;
+}
+
+/* ---- bandwidth cap ---- */
+/* combine the bandwidth level and the CPU effort into the knobs in use:
+   effort scales flicker and the active columns, and below 10% columns
+   it lowers the frame rate */
+static void quality_apply(void) {
+  double e = Q.effort, keep = e > 0.1 ? e : 0.1;
+  int div = e >= 0.1 ? 1 : (int)ceil(0.1 / e);
+  Q.flicker = OPT.flicker * (double)QUALITY_LEVELS[Q.level].flicker * e;
+  Q.fps_div = QUALITY_LEVELS[Q.level].fps_div;
+  if (div > Q.fps_div) Q.fps_div = div;
+  if (keep > Q.keep && COLS > 0) sched_reset(FRAME); /* wake idle columns */
+  Q.keep = keep;
+}
+
+/* apply quality level l; a colour depth change owes the screen a repaint */
+static void quality_set(int l) {
+  if (QUALITY_LEVELS[l].depth != Q.depth) {
+    Q.repaint = 1;
+    sched_reset(FRAME); /* re-rasterize every column in the new styles */
+  }
+  Q.level   = l;
+  Q.depth   = QUALITY_LEVELS[l].depth;
+  quality_apply();
+  if (l == 0) Q.tokens = (double)OPT.max_bps / 4.0; /* start with a full bucket */
+  if (!Q.reached[l]) Q.reached[l] = FRAME + 1;
+}
+
+/* whether an owed repaint can go out now, so idle frames must not be skipped */
+static inline int quality_repaint_due(void) {
+  return Q.repaint && Q.tokens >= 0.0;
+}
+
+/* whether the frame about to be rendered goes out; sets *full when it
+   carries the owed repaint. With the bucket empty, the level steps down
+   (one step per QUALITY_STEP_FRAMES) and the frame is still encoded;
+   only at the last level is it held back. The debt is paid off later. */
+static int quality_may_send(int *full) {
+  if (OPT.max_bps <= 0) return 1;
+  if (*full || Q.tokens >= 0.0) {
+    *full |= Q.repaint;
+    Q.repaint = 0;
+    return 1;
+  }
+  if (Q.level == QUALITY_COUNT - 1) return 0;
+  if (FRAME >= Q.step_at + QUALITY_STEP_FRAMES) {
+    Q.step_at = FRAME;
+    Q.calm = 0;
+    quality_set(Q.level + 1);
+  }
+  return 1;
+}
+
+/* a frame held back for lack of tokens; its changes go out with the next */
+static inline void quality_drop(void) {
+  if (!Q.first_drop) Q.first_drop = FRAME + 1;
+  Q.dropped++;
+  Q.win_dropped++;
+}
+
+/* account 'frames' frames that sent 'bytes' bytes. Once a second the
+   measured rate moves the quality one level: down when over budget or
+   when frames had to be dropped, up after three windows under 70% of it. */
+static void quality_tick(uint64_t frames, size_t bytes) {
+  if (OPT.max_bps <= 0) return;
+  double budget = (double)OPT.max_bps;
+  Q.tokens += (double)frames * budget / TARGET_FPS - (double)bytes;
+  if (Q.tokens > budget / 4.0) Q.tokens = budget / 4.0; /* burst of 1/4 s */
+
+  Q.win_frames += frames;
+  Q.win_bytes += bytes;
+  if (Q.win_frames < TARGET_FPS) return;
+  Q.rate = (double)Q.win_bytes * TARGET_FPS / (double)Q.win_frames;
+  int over = Q.rate > budget || Q.win_dropped > 0;
+  Q.win_frames = Q.win_bytes = Q.win_dropped = 0;
+
+  if (over && Q.level < QUALITY_COUNT - 1) {
+    Q.calm = 0;
+    quality_set(Q.level + 1);
+  } else if (!over && Q.rate < budget * 0.7 && Q.level > 0) {
+    if (++Q.calm >= 3) {
+      Q.calm = 0;
+      quality_set(Q.level - 1);
     }
+  } else {
+    Q.calm = 0;
+  }
+}
+
+/* ---- CPU budget ---- */
+static inline uint64_t cpu_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* charge the thread CPU time since the last mark to stage s (a syscall on
+   most systems, so only with --cpu-budget) */
+static inline void cpu_stage(int s) {
+  if (OPT.cpu_budget <= 0.0) return;
+  uint64_t t = cpu_now();
+  Q.stage_ns[s] += t - Q.cpu_mark;
+  Q.cpu_win_ns += t - Q.cpu_mark;
+  Q.cpu_mark = t;
+}
+
+/* account 'frames' elapsed frames. Once a second the measured CPU share
+   moves the effort toward budget / used. The square root halves each
+   correction and steps are capped at 30%. Nothing changes inside a +-10%
+   band. After a change the controller waits a window, because drops
+   already falling take that long to show it. */
+static void cpu_tick(uint64_t frames) {
+  if (OPT.cpu_budget <= 0.0) return;
+  Q.cpu_win_frames += frames;
+  if (Q.cpu_win_frames < TARGET_FPS) return;
+  Q.cpu_used = (double)Q.cpu_win_ns / ((double)Q.cpu_win_frames * (double)FRAME_NS);
+  Q.cpu_win_frames = Q.cpu_win_ns = 0;
+  if (Q.settle > 0) { Q.settle--; return; }
+
+  double ratio = OPT.cpu_budget / (Q.cpu_used > 1e-6 ? Q.cpu_used : 1e-6);
+  if (ratio > 0.9 && ratio < 1.1) return;
+  if (ratio >= 1.1 && Q.effort >= 1.0) return;
+  double step = sqrt(ratio);
+  if (step < 0.7) step = 0.7;
+  if (step > 1.3) step = 1.3;
+  double e = Q.effort * step;
+  if (e > 1.0) e = 1.0;
+  if (e < 0.02) e = 0.02;
+  Q.effort = e;
+  Q.settle = 1;
+  quality_apply();
+}
+
+/* ---- hardware counters ---- */
+/* --perf: cycles, instructions, cache and branch misses of this thread in
+   user space, read as one group at each stage boundary of the bench */
+enum { PERF_CYCLES, PERF_INSTR, PERF_CACHE_MISS, PERF_BRANCH_MISS, PERF_COUNT };
+static const char *const PERF_NAMES[PERF_COUNT] = {
+  "cycles", "instructions", "cache misses", "branch misses"
+};
+
+static struct {
+  int      leader;                  /* group fd, -1 = not counting */
+  int      slot[PERF_COUNT];        /* place in the group read, -1 = missing */
+  int      n;                       /* counters in the group */
+  int      stage;                   /* stage the counts since mark go to */
+  uint64_t mark[PERF_COUNT];
+  uint64_t count[STAGE_COUNT][PERF_COUNT];
+  const char *why;                  /* reason when nothing could be opened */
+} PERF = { -1, { -1, -1, -1, -1 }, 0, STAGE_OTHER, { 0 }, { { 0 } }, NULL };
+
+#ifdef __linux__
+static void perf_open(void) {
+  static const uint64_t config[PERF_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+  };
+  int err = 0;
+  for (int i = 0; i < PERF_COUNT; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[i];
+    attr.disabled = PERF.leader < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    long fd = syscall(SYS_perf_event_open, &attr, 0, -1, PERF.leader, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) { err = errno; continue; }
+    if (PERF.leader < 0) PERF.leader = (int)fd;
+    PERF.slot[i] = PERF.n++;
+  }
+  if (PERF.leader < 0) {
+    PERF.why = err == ENOENT || err == EOPNOTSUPP ? "no hardware events on this CPU or VM"
+             : err == EACCES || err == EPERM ? "not permitted (see kernel.perf_event_paranoid)"
+             : "perf_event_open failed";
+    return;
   }
+  ioctl(PERF.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(PERF.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
 }
 
-int main(void) {
+/* current values, scaled up if the kernel had to multiplex the group */
+static int perf_read(uint64_t v[PERF_COUNT]) {
+  uint64_t buf[3 + PERF_COUNT];
+  ssize_t n = read(PERF.leader, buf, sizeof(buf));
+  if (n < (ssize_t)((3 + (size_t)PERF.n) * sizeof(uint64_t))) return -1;
+  double scale = buf[2] && buf[2] < buf[1] ? (double)buf[1] / (double)buf[2] : 1.0;
+  for (int i = 0; i < PERF_COUNT; i++)
+    v[i] = PERF.slot[i] < 0 ? 0 : (uint64_t)((double)buf[3 + PERF.slot[i]] * scale);
+  return 0;
+}
+#else
+static void perf_open(void) { PERF.why = "needs Linux perf_event_open"; }
+static int perf_read(uint64_t v[PERF_COUNT]) { (void)v; return -1; }
+#endif
+
+/* charge the counts since the last mark to the running stage, then start
+   stage s (the bench's twin of cpu_stage) */
+static inline void perf_stage(int s) {
+  if (PERF.leader < 0) return;
+  uint64_t v[PERF_COUNT];
+  if (perf_read(v) != 0) return;
+  for (int i = 0; i < PERF_COUNT; i++) {
+    PERF.count[PERF.stage][i] += v[i] - PERF.mark[i];
+    PERF.mark[i] = v[i];
+  }
+  PERF.stage = s;
+}
+
+static void perf_report(double frames, double cells) {
+  static const char *const stage[] = { "simulate", "build", "render" };
+  if (PERF.leader < 0) {
+    printf("  perf        counters unavailable: %s\n", PERF.why ? PERF.why : "not opened");
+    return;
+  }
+  printf("  perf        %12s %12s %5s %12s %12s %11s\n", "cycles/frame", "instr/frame",
+         "IPC", "cache miss", "branch miss", "cycles/cell");
+  for (int s = STAGE_SIM; s <= STAGE_RENDER; s++) {
+    const uint64_t *c = PERF.count[s];
+    double v[PERF_COUNT];
+    for (int i = 0; i < PERF_COUNT; i++) v[i] = (double)c[i] / frames;
+    printf("  %-10s  %12.0f %12.0f %5.2f %12.1f %12.1f %11.2f\n", stage[s],
+           v[PERF_CYCLES], v[PERF_INSTR], v[PERF_CYCLES] > 0 ? v[PERF_INSTR] / v[PERF_CYCLES] : 0.0,
+           v[PERF_CACHE_MISS], v[PERF_BRANCH_MISS], v[PERF_CYCLES] / cells);
+  }
+  for (int i = 0; i < PERF_COUNT; i++)
+    if (PERF.slot[i] < 0) printf("  perf        %s not counted (shown as 0)\n", PERF_NAMES[i]);
+}
+
+/* ---- heap call counting ---- */
+#ifdef CATRIX_ALLOC_CHECK
+/* 'make alloc-check' links with --wrap for these four, so every heap call
+   catrix makes lands here first and is counted */
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t k, size_t n);
+void *__real_realloc(void *p, size_t n);
+void __real_free(void *p);
+void *__wrap_malloc(size_t n);
+void *__wrap_calloc(size_t k, size_t n);
+void *__wrap_realloc(void *p, size_t n);
+void __wrap_free(void *p);
+
+static uint64_t heap_calls = 0;
+
+void *__wrap_malloc(size_t n) { heap_calls++; return __real_malloc(n); }
+void *__wrap_calloc(size_t k, size_t n) { heap_calls++; return __real_calloc(k, n); }
+void *__wrap_realloc(void *p, size_t n) { heap_calls++; return __real_realloc(p, n); }
+void __wrap_free(void *p) { if (p) heap_calls++; __real_free(p); }
+#endif
+
+/* ---- benchmark ---- */
+/* headless: run the frame pipeline without a terminal and report costs */
+static int run_bench(void) {
+  uint64_t t_sim = 0, t_build = 0, t_render = 0;
+  uint64_t first_bytes = 0, drop_frames = 0;
+#ifdef CATRIX_ALLOC_CHECK
+  uint64_t heap_warm = 0;
+#endif
+  int force_full = 1, first = 1;
+
+  uint64_t t_seek = ns_now();
+  seek_frame(OPT.start_frame);
+  t_seek = ns_now() - t_seek;
+  if (OPT.perf) {
+    perf_open();
+    perf_stage(STAGE_OTHER);
+  }
+
+  uint64_t end = FRAME + (uint64_t)OPT.bench;
+  while (FRAME < end) {
+    uint64_t due = OPT.fall ? fall_due() : sched_due();
+    if (!force_full && !quality_repaint_due() && due > FRAME) {
+      /* nothing visible changes: these frames cost nothing */
+      uint64_t skip = (due < end ? due : end) - FRAME;
+      FRAME += skip;
+      STATS.skipped += skip;
+      drop_frames += skip * (uint64_t)pool_used;
+      quality_tick(skip, 0);
+      cpu_tick(skip);
+      continue;
+    }
+
+    cpu_stage(STAGE_OTHER);
+    perf_stage(STAGE_SIM);
+    uint64_t t0 = ns_now();
+    if (OPT.fall) fall_step();
+    else simulate_matrix();
+    cpu_stage(STAGE_SIM);
+    perf_stage(STAGE_BUILD);
+    uint64_t t1 = ns_now();
+    if (!OPT.fall) build_cur_grid();
+    if (shm_fd >= 0) shm_publish(force_full);
+    cpu_stage(STAGE_BUILD);
+    perf_stage(STAGE_RENDER);
+    uint64_t t2 = ns_now();
+    size_t len = 0;
+    if (quality_may_send(&force_full)) {
+      len = render_diff(force_full);
+    } else {
+      quality_drop();
+    }
+    cpu_stage(STAGE_RENDER);
+    perf_stage(STAGE_OTHER);
+    uint64_t t3 = ns_now();
+
+    if (first) first_bytes = len;
+#ifdef CATRIX_ALLOC_CHECK
+    if (first) heap_warm = heap_calls; /* the first frame is the warm-up */
+#endif
+    first = force_full = 0;
+    t_sim    += t1 - t0;
+    t_build  += t2 - t1;
+    t_render += t3 - t2;
+    uint64_t step = (uint64_t)Q.fps_div;
+    if (step > end - FRAME) step = end - FRAME;
+    drop_frames += step * (uint64_t)pool_used;
+    FRAME += step;
+    quality_tick(step, len);
+    cpu_tick(step);
+  }
+
+  double frames = (double)OPT.bench;
+  double cells  = (double)VIEW_COLS * (double)VIEW_ROWS;
+  double total  = (double)(t_sim + t_build + t_render);
+  double steady = frames > 1 ? (double)(STATS.bytes - first_bytes) / (frames - 1) : 0.0;
+  double glyph_bytes = 0.0;
+  for (int g = 0; g < GLYPH_COUNT; g++) {
+    /* expected over the alias table, so weights count */
+    double keep = ((double)GLYPH_PROB[g] + 1.0) / 4294967296.0;
+    glyph_bytes += keep * GLYPHS[g].len + (1.0 - keep) * GLYPHS[GLYPH_ALIAS[g]].len;
+  }
+  glyph_bytes /= (double)GLYPH_COUNT;
+
+  printf("catrix bench: %dx%d (%dx%d logical), %ld frames\n",
+         PHYS_COLS, PHYS_ROWS, VIEW_COLS, VIEW_ROWS, OPT.bench);
+  printf("  frames      %10llu rendered, %llu skipped (flicker %.2f%%, speed x%.2f)\n",
+         (unsigned long long)STATS.frames, (unsigned long long)STATS.skipped,
+         OPT.flicker * 100.0, (double)OPT.speed);
+  if (OPT.start_frame > 0)
+    printf("  seek        %10.1f us to frame %llu\n",
+           (double)t_seek / 1000.0, (unsigned long long)OPT.start_frame);
+  if (OPT.max_bps > 0)
+    printf("  bandwidth   budget %ld B/s, actual %.0f B/s (last second %.0f), level %d"
+           " (flicker x%.2f, %s, %u fps), %llu frames dropped\n",
+           OPT.max_bps, (double)STATS.bytes * TARGET_FPS / frames, Q.rate, Q.level,
+           (double)QUALITY_LEVELS[Q.level].flicker,
+           Q.depth == 0 ? "256 colours" : Q.depth == 1 ? "16 colours" : "one colour",
+           TARGET_FPS / (unsigned)Q.fps_div, (unsigned long long)Q.dropped);
+  if (OPT.max_bps > 0) {
+    /* frame each level was first set at ('-' = never), then the first drop */
+    printf("  levels     ");
+    for (int l = 0; l < QUALITY_COUNT; l++) {
+      if (Q.reached[l]) printf(" %llu", (unsigned long long)(Q.reached[l] - 1));
+      else printf(" -");
+    }
+    if (Q.first_drop) printf(", first drop at %llu", (unsigned long long)(Q.first_drop - 1));
+    printf("\n");
+  }
+  if (OPT.cpu_budget > 0.0) {
+    uint64_t cpu = 0;
+    for (int i = 0; i < STAGE_COUNT; i++) cpu += Q.stage_ns[i];
+    printf("  cpu         budget %.1f%%, used %.1f%% (last second %.1f%%), effort %.2f"
+           " (columns %.0f%%, flicker x%.2f, %u fps)\n",
+           OPT.cpu_budget * 100.0, (double)cpu / (frames * (double)FRAME_NS) * 100.0,
+           Q.cpu_used * 100.0, Q.effort, Q.keep * 100.0, Q.effort,
+           TARGET_FPS / (unsigned)Q.fps_div);
+    printf("  cpu stages  sim %.0f, build %.0f, render %.0f, other %.0f ns/frame\n",
+           (double)Q.stage_ns[STAGE_SIM] / frames, (double)Q.stage_ns[STAGE_BUILD] / frames,
+           (double)Q.stage_ns[STAGE_RENDER] / frames, (double)Q.stage_ns[STAGE_OTHER] / frames);
+  }
+  if (OPT.canvas_cols > 0)
+    printf("  canvas      %dx%d logical, viewport at %d,%d\n", COLS, ROWS, VIEW_X, VIEW_Y);
+  if (OPT.fall)
+    printf("  fall        %s, %.2f rows/frame, %.1f%% of cells lit (ring %.1f KiB)\n",
+           OPT.fall == FALL_SCROLL ? "scroll (SD)" : "rewrite",
+           0.3 * (double)OPT.speed, (double)fall_live / cells * 100.0,
+           cells * (double)sizeof(Cell) / 1024.0);
+  else if (OPT.spans)
+    printf("  state       spans %.1f KiB, viewport %s %.1f KiB, changes %.1f KiB\n",
+           (double)((size_t)COLS * (size_t)SPAN_CAP * sizeof(struct span)) / 1024.0,
+           OPT.counter_glyphs ? "epochs" : "glyphs",
+           cells * (double)(OPT.counter_glyphs ? sizeof(uint32_t) : sizeof(uint16_t)) / 1024.0,
+           (double)((size_t)chg_cap * (2u * sizeof(struct cell_ref) + 1u)) / 1024.0);
+  else
+    printf("  tiles       %zu live, %zu used of %zu (%.1f KiB), chunks %zu reserved + %zu grown\n",
+           tiles_live, tiles_total, (size_t)TILES_X * (size_t)TILES_Y,
+           (double)(tiles_total * sizeof(Tile)) / 1024.0, tile_reserved, tile_nchunks - tile_reserved);
+  double drops = (double)drop_frames / frames;
+  if (!OPT.fall)
+    printf("  drops       %10.1f /frame  (density %d, sparsity %.2f, %.2f per column)  %.1f ns/drop\n",
+           drops, OPT.density, OPT.sparsity, drops / (double)COLS,
+           (double)(t_sim + t_build) / frames / drops);
+  printf("  glyphs      %s (%d glyphs, %.2f bytes/glyph)\n",
+         glyph_set_name, GLYPH_COUNT, glyph_bytes);
+  if (OPT.gradient) {
+    int colours = 0;
+    for (int k = 0; k < OPT.gradient; k++) colours += SGR_MAP[STYLE_GRAD + k] == GRADIENT_SGR[k];
+    printf("  gradient    %d shades, %d distinct %s\n", OPT.gradient, colours,
+           OPT.truecolor ? "24-bit colours" : "cube colours");
+  }
+  printf("  simulate    %10.1f ns/frame\n", (double)t_sim / frames);
+  printf("  build       %10.1f ns/frame\n", (double)t_build / frames);
+  printf("  render      %10.1f ns/frame\n", (double)t_render / frames);
+  printf("  total       %10.1f ns/frame  %.2f ns/cell\n", total / frames, total / frames / cells);
+  printf("  full frame  %10llu bytes\n", (unsigned long long)first_bytes);
+  printf("  steady      %10.1f bytes/frame  %.3f bytes/cell\n", steady, steady / cells);
+  printf("  emitted     %10.1f cells/frame  %.1f moves/frame  %.2f row rewrites/frame (%s)\n",
+         (double)STATS.cells / frames, (double)STATS.runs / frames,
+         (double)STATS.rewrites / frames, OPT.adaptive ? "adaptive" : "diff only");
+  printf("  output      %s, %llu of %llu frames as iovec lists\n",
+         OPT.output == OUT_AUTO ? "auto" : OPT.output == OUT_COPY ? "copy" : "iovec",
+         (unsigned long long)STATS.iov_frames, (unsigned long long)STATS.frames);
+  if (OPT.perf) perf_report(frames, cells);
+#ifdef CATRIX_ALLOC_CHECK
+  heap_warm = heap_calls - heap_warm;
+  printf("  heap        %10llu calls after the first frame", (unsigned long long)heap_warm);
+  if (tile_nchunks > tile_reserved)
+    printf(", %zu for canvas chunks past the %u MiB reserve", tile_nchunks - tile_reserved, TILE_RESERVE >> 20);
+  printf("%s\n", heap_warm ? "  FAIL" : "");
+  if (heap_warm) return 1;
+#endif
+  return 0;
+}
+
+/* ---- command line ---- */
+static void usage(FILE *f) {
+  fprintf(f,
+    "usage: catrix [options]\n"
+    "  -g, --glyphs NAME   glyph set: ascii (default), katakana, binary\n"
+    "  -c, --chars STR     custom UTF-8 glyphs (each one column wide)\n"
+    "      --weights SPEC  weighted glyphs: \"W:GLYPHS ...\", e.g. \"5:0123456789 1:#$%%&\"\n"
+    "      --glyph-file F  weighted glyphs from a file, same format, # comments\n"
+    "  -s, --size WxH      fixed terminal size instead of querying the tty\n"
+    "      --canvas WxH    virtual canvas larger than the terminal\n"
+    "      --viewport X,Y  origin of the terminal on the canvas\n"
+    "  -d, --density N     drops per column, 1-16 (default 1)\n"
+    "      --sparsity S    share of time a column stays empty, 0-0.99 (default 0)\n"
+    "  -f, --flicker PCT   glyph changes per visible cell per frame (default 1)\n"
+    "      --speed X       drop speed scale (default 1)\n"
+    "      --encode MODE   adaptive (default): per row, diff runs or a rewrite,\n"
+    "                      whichever is shorter; diff: always diff runs\n"
+    "      --render MODE   spans (default): straight from the column spans;\n"
+    "                      grid: through the tiled cell grid\n"
+    "      --glyph-rng M   spans: counter (default): glyphs hashed from cell and\n"
+    "                      epoch; stored: a random glyph kept per cell\n"
+    "      --start-frame N start N frames in (rain already falling)\n"
+    "      --max-bps N     keep output under N bytes/s: less flicker, then fewer\n"
+    "                      colours, then a lower frame rate, then dropped frames;\n"
+    "                      the first screen and repaints after a resize or a\n"
+    "                      resume are always sent, so tiny budgets overshoot\n"
+    "      --cpu-budget P%% keep CPU use under P%% of one core: fewer active\n"
+    "                      columns and less flicker, then a lower frame rate\n"
+    "      --focus         ask the terminal for focus reports and drop to\n"
+    "                      4 fps while the window is unfocused\n"
+    "      --output MODE   auto (default): per frame, copy or iovec by run\n"
+    "                      length; copy: one buffer; iovec: writev of fragments\n"
+    "      --fall MODE     glyphs fall with the rain; scroll: the terminal\n"
+    "                      moves them (SD); rewrite: every moved cell is resent\n"
+    "      --gradient N    trail in N shades, 2-64, emitted only where the\n"
+    "                      quantised colour changes (default: 3 fixed shades)\n"
+    "      --truecolor     24-bit gradient shades instead of the 256-colour cube\n"
+    "      --shm NAME      publish the grid to POSIX shared memory /NAME\n"
+    "      --sync          wrap each frame in a synchronized update (mode 2026)\n"
+    "                      so terminals that support it show it whole\n"
+    "      --stats-sock P  serve a JSON snapshot of the live counters to each\n"
+    "                      client of the Unix socket P\n"
+    "      --seed N        random seed (default: time)\n"
+    "      --bench N       headless benchmark of N frames, print stats\n"
+    "      --perf          with --bench: cycles, instructions, cache and branch\n"
+    "                      misses per stage (Linux perf events)\n"
+    "  -h, --help          show this help\n");
+}
+
+static int parse_long(const char *s, long lo, long hi, long *out) {
+  char *end;
+  long v = strtol(s, &end, 10);
+  if (end == s || *end || v < lo || v > hi) return -1;
+  *out = v;
+  return 0;
+}
+
+static int parse_double(const char *s, double lo, double hi, double *out) {
+  char *end;
+  double v = strtod(s, &end);
+  if (end == s || *end || !(v >= lo && v <= hi)) return -1;
+  *out = v;
+  return 0;
+}
+
+/* "AxB" with the given separator(s) */
+static int parse_pair(const char *s, const char *seps, long lo, int *x, int *y) {
+  char *end;
+  long a = strtol(s, &end, 10);
+  if (end == s || !*end || !strchr(seps, *end)) return -1;
+  const char *t = end + 1;
+  long b = strtol(t, &end, 10);
+  if (end == t || *end || a < lo || b < lo || a > 100000 || b > 100000) return -1;
+  *x = (int)a; *y = (int)b;
+  return 0;
+}
+
+static int parse_args(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *a = argv[i];
+    const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+    long n;
+    double x;
+#define NEED_ARG() do { if (!v) { fprintf(stderr, "catrix: %s needs a value\n", a); return -1; } i++; } while (0)
+    if (!strcmp(a, "-h") || !strcmp(a, "--help")) {
+      usage(stdout);
+      exit(0);
+    } else if (!strcmp(a, "-g") || !strcmp(a, "--glyphs")) {
+      NEED_ARG(); OPT.glyphs = v;
+    } else if (!strcmp(a, "-c") || !strcmp(a, "--chars")) {
+      NEED_ARG(); OPT.chars = v;
+    } else if (!strcmp(a, "--weights")) {
+      NEED_ARG(); OPT.weights = v;
+    } else if (!strcmp(a, "--glyph-file")) {
+      NEED_ARG(); OPT.glyph_file = v;
+    } else if (!strcmp(a, "-s") || !strcmp(a, "--size")) {
+      NEED_ARG();
+      if (parse_pair(v, "xX", 1, &OPT.fixed_cols, &OPT.fixed_rows) != 0) goto bad;
+    } else if (!strcmp(a, "--canvas")) {
+      NEED_ARG();
+      if (parse_pair(v, "xX", 1, &OPT.canvas_cols, &OPT.canvas_rows) != 0) goto bad;
+    } else if (!strcmp(a, "--viewport")) {
+      NEED_ARG();
+      if (parse_pair(v, ",", 0, &OPT.view_x, &OPT.view_y) != 0) goto bad;
+    } else if (!strcmp(a, "-d") || !strcmp(a, "--density")) {
+      NEED_ARG();
+      if (parse_long(v, 1, 16, &n) != 0) goto bad;
+      OPT.density = (int)n;
+    } else if (!strcmp(a, "--sparsity")) {
+      NEED_ARG();
+      if (parse_double(v, 0.0, 0.99, &x) != 0) goto bad;
+      OPT.sparsity = x;
+    } else if (!strcmp(a, "-f") || !strcmp(a, "--flicker")) {
+      NEED_ARG();
+      if (parse_double(v, 0.0, 100.0, &x) != 0) goto bad;
+      OPT.flicker = x / 100.0;
+    } else if (!strcmp(a, "--speed")) {
+      NEED_ARG();
+      if (parse_double(v, 0.01, 10.0, &x) != 0) goto bad;
+      OPT.speed = (float)x;
+    } else if (!strcmp(a, "--encode")) {
+      NEED_ARG();
+      if (!strcmp(v, "adaptive")) OPT.adaptive = 1;
+      else if (!strcmp(v, "diff")) OPT.adaptive = 0;
+      else goto bad;
+    } else if (!strcmp(a, "--render")) {
+      NEED_ARG();
+      if (!strcmp(v, "grid")) OPT.spans = 0;
+      else if (!strcmp(v, "spans")) OPT.spans = 1;
+      else goto bad;
+    } else if (!strcmp(a, "--glyph-rng")) {
+      NEED_ARG();
+      if (!strcmp(v, "counter")) OPT.counter_glyphs = 1;
+      else if (!strcmp(v, "stored")) OPT.counter_glyphs = 0;
+      else goto bad;
+    } else if (!strcmp(a, "--start-frame")) {
+      NEED_ARG();
+      if (parse_long(v, 0, 0x7FFFFFFFL, &n) != 0) goto bad;
+      OPT.start_frame = (uint64_t)n;
+    } else if (!strcmp(a, "--max-bps")) {
+      NEED_ARG();
+      if (parse_long(v, 100, 0x7FFFFFFFL, &n) != 0) goto bad;
+      OPT.max_bps = n;
+    } else if (!strcmp(a, "--cpu-budget")) {
+      NEED_ARG();
+      char pct[32];
+      size_t len = strlen(v);
+      if (len == 0 || len >= sizeof(pct)) goto bad;
+      memcpy(pct, v, len + 1);
+      if (pct[len - 1] == '%') pct[len - 1] = 0;
+      if (parse_double(pct, 0.1, 100.0, &x) != 0) goto bad;
+      OPT.cpu_budget = x / 100.0;
+    } else if (!strcmp(a, "--perf")) {
+      OPT.perf = 1;
+    } else if (!strcmp(a, "--focus")) {
+      OPT.focus = 1;
+    } else if (!strcmp(a, "--output")) {
+      NEED_ARG();
+      if (!strcmp(v, "auto")) OPT.output = OUT_AUTO;
+      else if (!strcmp(v, "copy")) OPT.output = OUT_COPY;
+      else if (!strcmp(v, "iovec")) OPT.output = OUT_IOVEC;
+      else goto bad;
+      use_iov = OPT.output == OUT_IOVEC;
+    } else if (!strcmp(a, "--fall")) {
+      NEED_ARG();
+      if (!strcmp(v, "scroll")) OPT.fall = FALL_SCROLL;
+      else if (!strcmp(v, "rewrite")) OPT.fall = FALL_REWRITE;
+      else goto bad;
+    } else if (!strcmp(a, "--gradient")) {
+      NEED_ARG();
+      if (parse_long(v, 2, GRADIENT_MAX, &n) != 0) goto bad;
+      OPT.gradient = (int)n;
+    } else if (!strcmp(a, "--truecolor")) {
+      OPT.truecolor = 1;
+    } else if (!strcmp(a, "--shm")) {
+      NEED_ARG();
+      if (!*v || strlen(v) > 200 || strchr(v + 1, '/')) goto bad;
+      OPT.shm = v;
+    } else if (!strcmp(a, "--sync")) {
+      OPT.sync = 1;
+    } else if (!strcmp(a, "--stats-sock")) {
+      NEED_ARG();
+      if (!*v) goto bad;
+      OPT.stats_sock = v;
+    } else if (!strcmp(a, "--seed")) {
+      NEED_ARG();
+      if (parse_long(v, 0, 0x7FFFFFFFL, &n) != 0) goto bad;
+      OPT.seed = (unsigned)n; OPT.have_seed = 1;
+    } else if (!strcmp(a, "--bench")) {
+      NEED_ARG();
+      if (parse_long(v, 1, 0x7FFFFFFFL, &n) != 0) goto bad;
+      OPT.bench = n;
+    } else {
+      fprintf(stderr, "catrix: unknown option '%s'\n", a);
+      usage(stderr);
+      return -1;
+    }
+#undef NEED_ARG
+    continue;
+  bad:
+    fprintf(stderr, "catrix: invalid value '%s' for %s\n", v, a);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (parse_args(argc, argv) != 0) return 2;
+  if (OPT.bench > 0 && OPT.fixed_cols == 0) {
+    OPT.fixed_cols = 80;
+    OPT.fixed_rows = 24;
+  }
+  if (OPT.bench > 0 && OPT.output == OUT_AUTO) OPT.output = OUT_COPY; /* no writev to time */
+
+  if (init_glyphs() != 0) {
+    fprintf(stderr, "catrix: bad glyph set (use ascii, katakana, binary, valid UTF-8 --chars"
+                    " or W:GLYPHS groups with W > 0 for --weights/--glyph-file)\n");
+    return 2;
+  }
+
+  quality_set(0);
   atexit(cleanup);
-  signal(SIGINT,  handle_exit_signal);
-  signal(SIGTERM, handle_exit_signal);
+  on_signal(SIGINT,  handle_exit_signal, 0);
+  on_signal(SIGTERM, handle_exit_signal, 0);
 #ifdef SIGWINCH
-  signal(SIGWINCH, handle_winch);
+  on_signal(SIGWINCH, handle_winch, SA_RESTART);
 #endif
+  if (OPT.bench == 0) {
+    on_signal(SIGTSTP, handle_tstp, SA_RESTART);
+    on_signal(SIGCONT, handle_cont, SA_RESTART);
+  }
 
-  srand((unsigned)time(NULL));
+  unsigned seed = OPT.have_seed ? OPT.seed : (unsigned)time(NULL);
+  srand(seed);
+  RNG_KEY = mix64(seed);
   if (init_world() != 0) {
     fprintf(stderr, "Failed to initialize matrix\n");
     return 1;
   }
-
-  /* hide cursor & home */
-  {
-    const char *seq = "\x1b[?25l\x1b[H";
-    write(1, seq, (size_t)strlen(seq));
+  if (OPT.shm && shm_init() != 0) {
+    perror("catrix: --shm");
+    return 1;
+  }
+  if (OPT.stats_sock && OPT.bench == 0) {
+    if (stats_open() != 0) {
+      perror("catrix: --stats-sock");
+      return 1;
+    }
+    stats_t0 = ns_now();
   }
+  if (OPT.cpu_budget > 0.0) Q.cpu_mark = cpu_now();
+  if (OPT.bench > 0) return run_bench();
+  seek_frame(OPT.start_frame);
 
-  uint64_t last = ns_now();
-  uint64_t next = last + FRAME_NS;
+  tty_enter();
+
+  uint64_t next = ns_now(); /* when FRAME is due on screen */
   int force_full = 1;
 
   for (;;) {
     if (exit_pending) break;
 
+    if (suspend_pending) {
+      /* ^Z: give the terminal back, then stop for real */
+      suspend_pending = 0;
+      tty_leave();
+      on_signal(SIGTSTP, SIG_DFL, 0);
+      raise(SIGTSTP);
+      on_signal(SIGTSTP, handle_tstp, SA_RESTART); /* running again after SIGCONT */
+      resume_pending = 1;
+    }
+    if (resume_pending) {
+      /* the screen and tty modes may have been changed while stopped */
+      resume_pending = 0;
+      tty_enter();
+      force_full = 1;
+      next = ns_now();
+    }
+
     /* detect growth/shrink even if SIGWINCH is swallowed */
     poll_resize();
     if (resize_pending) apply_resize_if_needed(&force_full);
     if (COLS <= 0 || ROWS <= 0) continue;
 
-    build_cur_grid();
-    render_diff(force_full);
-    force_full = 0;
-
-    simulate_matrix();
+    uint64_t due = OPT.fall ? fall_due() : sched_due();
+    uint64_t step = 1;
+    size_t len = 0;
+    if (!force_full && !quality_repaint_due() && due > FRAME) {
+      /* nothing visible changes before 'due': skip build, diff and write and
+         sleep through (polling for resizes now and then) */
+      step = due - FRAME;
+      uint64_t cap = focused ? IDLE_POLL_FRAMES : UNFOCUSED_FPS_DIV;
+      if (step > cap) step = cap;
+      STATS.skipped += step;
+    } else {
+      /* probes: frame__start(frame, full), simulate__done(frame, drops),
+         build__done(frame), render__done(frame, bytes, cells),
+         write__done(bytes, iovecs), frame__end(frame, bytes, sent) */
+      PROBE2(frame__start, FRAME, force_full);
+      uint64_t t0 = stats_fd >= 0 ? ns_now() : 0;
+      cpu_stage(STAGE_OTHER);
+      if (OPT.fall) fall_step();
+      else simulate_matrix();
+      PROBE2(simulate__done, FRAME, pool_used);
+      cpu_stage(STAGE_SIM);
+      if (!OPT.fall) build_cur_grid();
+      if (shm_fd >= 0) shm_publish(force_full);
+      PROBE1(build__done, FRAME);
+      cpu_stage(STAGE_BUILD);
+      int sent = quality_may_send(&force_full);
+      if (sent) {
+        uint64_t cells = STATS.cells;
+        len = render_diff(force_full);
+        PROBE3(render__done, FRAME, len, STATS.cells - cells);
+        cpu_stage(STAGE_RENDER);
+        flush_frame(len);
+        cpu_stage(STAGE_WRITE);
+        if (stats_fd >= 0) stats_frame(t0, ns_now(), len);
+        force_full = 0;
+      } else {
+        quality_drop(); /* over budget: changes carry over to the next frame */
+      }
+      PROBE3(frame__end, FRAME, len, sent);
+      step = (uint64_t)Q.fps_div;
+      if (!focused && step < UNFOCUSED_FPS_DIV) step = UNFOCUSED_FPS_DIV;
+    }
+    quality_tick(step, len);
+    cpu_tick(step);
+    if (stats_fd >= 0) stats_serve(ns_now());
 
-    sleep_until(next);
+    FRAME += step;
+    next += step * FRAME_NS;
+    if (!resize_pending) sleep_until(next); /* a SIGWINCH mid-frame is not slept on */
+    if (read_focus()) next = ns_now(); /* back to full rate at once */
     uint64_t now = ns_now();
-    next = (now > next + FRAME_NS) ? now + FRAME_NS : next + FRAME_NS;
+    if (now > next + FRAME_NS) next = now; /* fell behind: don't try to catch up */
   }
   return 0;
 }
@@ -0,0 +1,456 @@
+/* ptybench.c - run catrix under a pseudo-terminal and measure what the
+   terminal side sees: frame latency at a given drain rate, achieved FPS,
+   bytes per frame, and how long a resize takes to reach the screen.
+
+   usage: ptybench [options] [-- catrix options]
+     -c PATH    catrix binary (default ./build/catrix)
+     -s WxH     window size (default 200x60)
+     -b BPS     drain rate of the simulated terminal in bytes/s, 0 = as fast
+                as possible (default 0)
+     -q BYTES   terminal input queue; when it is full ptybench stops reading
+                and catrix blocks in write (default 65536)
+     -t SECS    run time (default 5)
+     -r N       resizes: N window size changes, spread over the run, between
+                WxH and W2xH2 (default 0)
+     -R W2xH2   the other size for -r (default 3/4 of WxH)
+     -e         focus and job control events: the run is cut into five
+                phases, started by nothing, ESC[O (focus lost), ESC[I
+                (focus back), SIGTSTP and SIGCONT; catrix runs with
+                --focus
+
+   catrix runs with --sync, so every frame arrives between the synchronized
+   update marks ESC[?2026h and ESC[?2026l. A frame's latency runs from its
+   begin mark entering the queue (catrix writes a frame in one call right
+   after building it, so this is when the frame was handed over) to its end
+   mark being drained. While the queue is full, catrix's output waits in the
+   kernel's pty buffer before ptybench reads it, and that wait is not
+   counted: under a limited drain, latencies are low by up to the pty
+   buffer size divided by BPS.
+
+   Each resize is sent at a random point of the frame period, so it does
+   not always land just after a frame. It is reported twice: until the
+   repaint (the first frame with ESC[2J) is handed over, which is catrix's
+   own cost, and until that frame is drained. catrix restarts the rain on
+   a resize, so the repaint is nearly empty unless catrix runs with
+   --canvas.
+
+   With -e, bytes/s and FPS are reported per phase, with the time from
+   ESC[I to the next frame and from SIGCONT to the repaint. catrix runs
+   in its own foreground job under a session leader, as under a shell:
+   the kernel ignores SIGTSTP's stop in an orphaned job. */
+
+#define _XOPEN_SOURCE 700
+#define _DARWIN_C_SOURCE 1
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#define NSEC_PER_SEC 1000000000ull
+#define MAX_FRAMES 65536 /* frames kept for percentiles */
+#define MAX_RESIZES 256
+
+static const char MARK_BEGIN[] = "\x1b[?2026h";
+static const char MARK_END[]   = "\x1b[?2026l";
+static const char CLEAR[]      = "\x1b[2J";  /* starts every full repaint */
+#define MARK_LEN 8
+#define CLEAR_LEN 4
+#define FRAME_NS ((uint64_t)NSEC_PER_SEC / 60) /* catrix's frame period */
+
+static struct {
+  const char *catrix;
+  int cols, rows, cols2, rows2;
+  double bps;
+  size_t queue;
+  double secs;
+  int resizes;
+  int events;
+} OPT = { "./build/catrix", 200, 60, 0, 0, 0.0, 65536, 5.0, 0, 0 };
+
+/* frames seen, in stream order: where each ends and when it was handed over */
+struct frame {
+  uint64_t begin_off, end_off; /* stream offsets of the marks' first bytes */
+  uint64_t begin_ns;           /* begin mark entered the queue */
+  uint64_t done_ns;            /* end mark drained, 0 = not yet */
+};
+
+static struct frame *frames;
+static int nframes = 0, ndone = 0;
+static int unbalanced = 0; /* marks out of order: a frame not bracketed */
+
+/* resizes: when the ioctl was made and when the first full repaint that
+   began after it was drained */
+static struct {
+  uint64_t at_ns;
+  int      first;   /* index of that frame, -1 = none yet */
+} RESIZE[MAX_RESIZES];
+static int nresize = 0;
+
+/* -e: the phases and what starts them; a phase's start also records
+   where the stream and the frames were */
+enum { PH_FOCUSED, PH_UNFOCUSED, PH_REFOCUSED, PH_STOPPED, PH_RESUMED, PH_COUNT };
+static const char *const PHASE_NAME[PH_COUNT] = {
+  "focused", "unfocused", "refocused", "stopped", "resumed"
+};
+static struct {
+  uint64_t at_ns, in_off;
+  int frame;   /* first frame that began in the phase */
+} PHASE[PH_COUNT + 1];
+static int nphase = 0;
+static int repaint_first = -1; /* first full repaint after SIGCONT */
+
+static inline uint64_t ns_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/* ---- pty ---- */
+static int set_size(int fd, int cols, int rows) {
+  struct winsize w;
+  memset(&w, 0, sizeof(w));
+  w.ws_col = (unsigned short)cols;
+  w.ws_row = (unsigned short)rows;
+  return ioctl(fd, TIOCSWINSZ, &w);
+}
+
+/* a new pty sized cols x rows running catrix on its slave side, which
+   becomes the child's controlling terminal so a resize sends SIGWINCH.
+   The child stays as session leader and waits; catrix is its foreground
+   job. */
+static int spawn(char **argv, pid_t *pid) {
+  int m = posix_openpt(O_RDWR | O_NOCTTY);
+  if (m < 0 || grantpt(m) != 0 || unlockpt(m) != 0) return -1;
+  const char *slave = ptsname(m);
+  if (!slave || set_size(m, OPT.cols, OPT.rows) != 0) return -1;
+  *pid = fork();
+  if (*pid < 0) return -1;
+  if (*pid == 0) {
+    setsid();
+    int s = open(slave, O_RDWR); /* first tty opened after setsid: controlling */
+    if (s < 0) _exit(127);
+#ifdef TIOCSCTTY
+    ioctl(s, TIOCSCTTY, 0);
+#endif
+    dup2(s, 0); dup2(s, 1); dup2(s, 2);
+    if (s > 2) close(s);
+    close(m);
+    pid_t c = fork();
+    if (c == 0) {
+      setpgid(0, 0);
+      signal(SIGTTOU, SIG_IGN); /* taking the terminal from the background */
+      tcsetpgrp(0, getpid());
+      signal(SIGTTOU, SIG_DFL);
+      execv(OPT.catrix, argv);
+      _exit(127);
+    }
+    int st = 0;
+    while (c > 0 && waitpid(c, &st, 0) < 0 && errno == EINTR) {}
+    _exit(c > 0 && WIFEXITED(st) ? WEXITSTATUS(st) : 127);
+  }
+  fcntl(m, F_SETFL, fcntl(m, F_GETFL) | O_NONBLOCK);
+  return m;
+}
+
+/* ---- stream ---- */
+/* marks may be split across reads: keep how much of each matched so far */
+static int match_b = 0, match_e = 0, match_c = 0;
+static uint64_t in_off = 0;
+
+static void scan(const char *p, size_t n, uint64_t now) {
+  for (size_t i = 0; i < n; i++, in_off++) {
+    char c = p[i];
+    match_b = c == MARK_BEGIN[match_b] ? match_b + 1 : c == MARK_BEGIN[0];
+    match_e = c == MARK_END[match_e] ? match_e + 1 : c == MARK_END[0];
+    match_c = c == CLEAR[match_c] ? match_c + 1 : c == CLEAR[0];
+    if (match_b == MARK_LEN) {
+      match_b = 0;
+      if (nframes > 0 && frames[nframes - 1].end_off == UINT64_MAX) unbalanced++;
+      if (nframes < MAX_FRAMES) {
+        struct frame *f = &frames[nframes++];
+        f->begin_off = in_off + 1 - MARK_LEN;
+        f->end_off = UINT64_MAX;
+        f->begin_ns = now;
+        f->done_ns = 0;
+      }
+    }
+    if (match_c == CLEAR_LEN) {
+      match_c = 0;
+      if (nframes > 0 && frames[nframes - 1].end_off == UINT64_MAX) {
+        const struct frame *f = &frames[nframes - 1];
+        for (int k = 0; k < nresize; k++)
+          if (RESIZE[k].first < 0 && RESIZE[k].at_ns <= f->begin_ns) RESIZE[k].first = nframes - 1;
+        if (nphase > PH_RESUMED && repaint_first < 0 && PHASE[PH_RESUMED].at_ns <= f->begin_ns)
+          repaint_first = nframes - 1;
+      }
+    }
+    if (match_e == MARK_LEN) {
+      match_e = 0;
+      if (nframes > 0 && frames[nframes - 1].end_off == UINT64_MAX)
+        frames[nframes - 1].end_off = in_off + 1 - MARK_LEN;
+      else
+        unbalanced++;
+    }
+  }
+}
+
+/* bytes [0, out_off) have been drained by the simulated terminal */
+static void drained(uint64_t out_off, uint64_t now) {
+  while (ndone < nframes && frames[ndone].end_off != UINT64_MAX &&
+         frames[ndone].end_off + MARK_LEN <= out_off) {
+    frames[ndone].done_ns = now;
+    ndone++;
+  }
+}
+
+/* ---- report ---- */
+/* signal the pty's foreground job, catrix */
+static void signal_job(int m, int sig) {
+  pid_t g = tcgetpgrp(m);
+  if (g > 0) kill(-g, sig);
+}
+
+/* -e: start phase nphase, by sending its event to catrix */
+static void phase_start(int m, uint64_t now) {
+  static const char FOCUS_OUT[] = "\x1b[O", FOCUS_IN[] = "\x1b[I";
+  if (nphase == PH_UNFOCUSED) (void)write(m, FOCUS_OUT, 3);
+  else if (nphase == PH_REFOCUSED) (void)write(m, FOCUS_IN, 3);
+  else if (nphase == PH_STOPPED) signal_job(m, SIGTSTP);
+  else if (nphase == PH_RESUMED) signal_job(m, SIGCONT);
+  PHASE[nphase].at_ns = now;
+  PHASE[nphase].in_off = in_off;
+  PHASE[nphase].frame = nframes;
+  nphase++;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void percentiles(const char *what, uint64_t *v, int n) {
+  if (n == 0) { printf("  %-12s none\n", what); return; }
+  qsort(v, (size_t)n, sizeof(*v), cmp_u64);
+  printf("  %-12s p50 %.3f  p90 %.3f  p99 %.3f  max %.3f ms\n", what,
+         (double)v[(n - 1) * 50 / 100] / 1e6, (double)v[(n - 1) * 90 / 100] / 1e6,
+         (double)v[(n - 1) * 99 / 100] / 1e6, (double)v[n - 1] / 1e6);
+}
+
+/* ---- command line ---- */
+static void usage(FILE *f) {
+  fprintf(f,
+    "usage: ptybench [options] [-- catrix options]\n"
+    "  -c PATH    catrix binary (default ./build/catrix)\n"
+    "  -s WxH     window size (default 200x60)\n"
+    "  -b BPS     terminal drain rate in bytes/s, 0 = unlimited (default)\n"
+    "  -q BYTES   terminal input queue (default 65536)\n"
+    "  -t SECS    run time (default 5)\n"
+    "  -r N       N window resizes spread over the run (default 0)\n"
+    "  -R W2xH2   the other size for -r (default 3/4 of WxH)\n"
+    "  -e         phases: focused, ESC[O, ESC[I, SIGTSTP, SIGCONT\n");
+}
+
+static int parse_size(const char *s, int *w, int *h) {
+  char *end;
+  long a = strtol(s, &end, 10);
+  if (end == s || (*end != 'x' && *end != 'X')) return -1;
+  const char *t = end + 1;
+  long b = strtol(t, &end, 10);
+  if (end == t || *end || a < 2 || b < 2 || a > 10000 || b > 10000) return -1;
+  *w = (int)a; *h = (int)b;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int i = 1;
+  for (; i < argc; i++) {
+    const char *a = argv[i];
+    const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (!strcmp(a, "--")) { i++; break; }
+    if (!strcmp(a, "-h")) { usage(stdout); return 0; }
+    if (!strcmp(a, "-e")) { OPT.events = 1; continue; }
+    if (!v) goto bad;
+    i++;
+    if (!strcmp(a, "-c")) OPT.catrix = v;
+    else if (!strcmp(a, "-s")) { if (parse_size(v, &OPT.cols, &OPT.rows) != 0) goto bad; }
+    else if (!strcmp(a, "-R")) { if (parse_size(v, &OPT.cols2, &OPT.rows2) != 0) goto bad; }
+    else if (!strcmp(a, "-b")) OPT.bps = atof(v);
+    else if (!strcmp(a, "-q")) OPT.queue = (size_t)atol(v);
+    else if (!strcmp(a, "-t")) OPT.secs = atof(v);
+    else if (!strcmp(a, "-r")) OPT.resizes = atoi(v);
+    else goto bad;
+    continue;
+  bad:
+    fprintf(stderr, "ptybench: bad option '%s'\n", a);
+    usage(stderr);
+    return 2;
+  }
+  if (OPT.queue < 64 || OPT.secs <= 0.0 || OPT.bps < 0.0 ||
+      OPT.resizes < 0 || OPT.resizes > MAX_RESIZES) {
+    usage(stderr);
+    return 2;
+  }
+  if (OPT.cols2 == 0) { OPT.cols2 = OPT.cols * 3 / 4; OPT.rows2 = OPT.rows * 3 / 4; }
+
+  /* catrix, its options after --, then --sync (and --focus) */
+  char **cargv = calloc((size_t)(argc - i + 4), sizeof(char *));
+  char *queue = malloc(OPT.queue);
+  frames = calloc(MAX_FRAMES, sizeof(*frames));
+  if (!cargv || !queue || !frames) return 1;
+  int n = 0;
+  cargv[n++] = (char *)OPT.catrix;
+  for (; i < argc; i++) cargv[n++] = argv[i];
+  cargv[n++] = "--sync";
+  if (OPT.events) cargv[n++] = "--focus";
+  cargv[n] = NULL;
+
+  signal(SIGPIPE, SIG_IGN);
+  pid_t pid;
+  int m = spawn(cargv, &pid);
+  if (m < 0) { perror("ptybench: pty"); return 1; }
+
+  /* the queue is a ring: bytes [out_off, in_off) of the stream are in it */
+  uint64_t out_off = 0;
+  uint64_t t0 = ns_now(), end = t0 + (uint64_t)(OPT.secs * 1e9), last = t0;
+  double tokens = 0.0;
+  int eof = 0;
+  /* resize k of N at (k + 1) / (N + 1) of the run plus a random part of a
+     frame period, alternating sizes */
+  srand(1);
+  uint64_t resize_at = UINT64_MAX;
+  if (OPT.resizes > 0)
+    resize_at = t0 + (uint64_t)((double)(end - t0) / (OPT.resizes + 1)) + (uint64_t)rand() % FRAME_NS;
+  if (OPT.events) phase_start(m, t0);
+  while (!eof) {
+    uint64_t now = ns_now();
+    if (now >= end) break;
+
+    if (OPT.events && nphase < PH_COUNT && now >= t0 + (end - t0) * (uint64_t)nphase / PH_COUNT)
+      phase_start(m, now);
+
+    if (now >= resize_at) {
+      int big = nresize % 2;
+      set_size(m, big ? OPT.cols : OPT.cols2, big ? OPT.rows : OPT.rows2);
+      RESIZE[nresize].at_ns = ns_now();
+      RESIZE[nresize].first = -1;
+      nresize++;
+      resize_at = nresize < OPT.resizes
+        ? t0 + (uint64_t)((double)(end - t0) * (nresize + 1) / (OPT.resizes + 1)) + (uint64_t)rand() % FRAME_NS
+        : UINT64_MAX;
+    }
+
+    /* take in what fits */
+    size_t used = (size_t)(in_off - out_off);
+    while (used < OPT.queue) {
+      size_t at = (size_t)(in_off % OPT.queue);
+      size_t room = OPT.queue - used;
+      if (room > OPT.queue - at) room = OPT.queue - at;
+      ssize_t r = read(m, queue + at, room);
+      if (r <= 0) {
+        if (r == 0 || (errno != EAGAIN && errno != EINTR)) eof = 1; /* EIO: slave closed */
+        break;
+      }
+      scan(queue + at, (size_t)r, ns_now());
+      used += (size_t)r;
+    }
+
+    /* drain at the terminal's rate */
+    now = ns_now();
+    if (OPT.bps > 0.0) {
+      tokens += (double)(now - last) * OPT.bps / 1e9;
+      uint64_t take = (uint64_t)tokens < in_off - out_off ? (uint64_t)tokens : in_off - out_off;
+      out_off += take;
+      tokens -= (double)take;
+      if (out_off == in_off) tokens = 0.0; /* idle time is not banked */
+    } else {
+      out_off = in_off;
+    }
+    last = now;
+    drained(out_off, now);
+
+    /* wait for output, or for the next drain step when the queue is full,
+       but not past the next resize */
+    struct pollfd p = { m, POLLIN, 0 };
+    int full = in_off - out_off >= OPT.queue;
+    int wait = full || OPT.bps > 0.0 ? 1 : 10;
+    now = ns_now();
+    if (resize_at < now + (uint64_t)wait * 1000000u)
+      wait = resize_at > now ? (int)((resize_at - now) / 1000000u) : 0;
+    poll(full ? NULL : &p, full ? 0 : 1, wait);
+  }
+  PHASE[nphase].at_ns = ns_now();
+  PHASE[nphase].in_off = in_off;
+  PHASE[nphase].frame = nframes;
+  signal_job(m, SIGTERM);
+  signal_job(m, SIGCONT);
+  waitpid(pid, NULL, 0);
+  double secs = (double)(ns_now() - t0) / 1e9;
+
+  /* latency and size of every drained frame but the first (full) one */
+  uint64_t *lat = calloc((size_t)(ndone ? ndone : 1), sizeof(uint64_t));
+  uint64_t *res = calloc(MAX_RESIZES, sizeof(uint64_t));
+  uint64_t *rcost = calloc(MAX_RESIZES, sizeof(uint64_t));
+  if (!lat || !res || !rcost) return 1;
+  uint64_t bytes = 0;
+  int nl = 0;
+  for (int k = 1; k < ndone; k++) {
+    lat[nl++] = frames[k].done_ns - frames[k].begin_ns;
+    bytes += frames[k].end_off + MARK_LEN - frames[k].begin_off;
+  }
+  int nr = 0;
+  uint64_t rbytes = 0;
+  for (int k = 0; k < nresize; k++) {
+    int f = RESIZE[k].first;
+    if (f < 0 || f >= ndone) continue;
+    rcost[nr] = frames[f].begin_ns - RESIZE[k].at_ns;
+    res[nr++] = frames[f].done_ns - RESIZE[k].at_ns;
+    rbytes += frames[f].end_off + MARK_LEN - frames[f].begin_off;
+  }
+
+  printf("ptybench: %dx%d, %.1f s, drain %s, queue %zu bytes\n", OPT.cols, OPT.rows, secs,
+         OPT.bps > 0.0 ? "limited" : "unlimited", OPT.queue);
+  if (OPT.bps > 0.0) printf("  drain rate   %.0f bytes/s\n", OPT.bps);
+  printf("  frames       %d drained, %.1f fps\n", ndone, (double)ndone / secs);
+  printf("  bytes/frame  %.1f\n", nl ? (double)bytes / nl : 0.0);
+  printf("  throughput   %.0f bytes/s\n", (double)out_off / secs);
+  percentiles("latency", lat, nl);
+  if (unbalanced) printf("  sync marks   %d out of order\n", unbalanced);
+  if (OPT.resizes > 0) {
+    printf("  resizes      %d of %d repainted, %.1f bytes/repaint, %dx%d <-> %dx%d\n",
+           nr, nresize, nr ? (double)rbytes / nr : 0.0, OPT.cols, OPT.rows, OPT.cols2, OPT.rows2);
+    percentiles("resize out", rcost, nr);
+    percentiles("resize shown", res, nr);
+  }
+  for (int k = 0; k < nphase; k++) {
+    double d = (double)(PHASE[k + 1].at_ns - PHASE[k].at_ns) / 1e9;
+    printf("  %-12s %.0f bytes/s, %.1f fps\n", PHASE_NAME[k],
+           (double)(PHASE[k + 1].in_off - PHASE[k].in_off) / d, (PHASE[k + 1].frame - PHASE[k].frame) / d);
+  }
+  if (nphase > PH_REFOCUSED) {
+    int f = PHASE[PH_REFOCUSED].frame;
+    if (f < nframes)
+      printf("  refocus      next frame after %.3f ms\n",
+             (double)(frames[f].begin_ns - PHASE[PH_REFOCUSED].at_ns) / 1e6);
+  }
+  if (nphase > PH_RESUMED) {
+    int f = repaint_first;
+    if (f >= 0 && f < ndone)
+      printf("  resume       repaint out after %.3f ms, shown after %.3f ms, %llu bytes\n",
+             (double)(frames[f].begin_ns - PHASE[PH_RESUMED].at_ns) / 1e6,
+             (double)(frames[f].done_ns - PHASE[PH_RESUMED].at_ns) / 1e6,
+             (unsigned long long)(frames[f].end_off + MARK_LEN - frames[f].begin_off));
+    else
+      printf("  resume       no repaint\n");
+  }
+  return unbalanced != 0;
+}